@@ -0,0 +1,29 @@
+#!/usr/bin/env ruby
+# Bulk insert: per-key Ruby loop vs the native add_many.
+#
+#   ruby -I lib benchmark/batch_add.rb [N]
+
+require "fast_bloom_filter"
+require "benchmark"
+
+N = (ARGV[0] || 2_000_000).to_i
+
+keys = N.times.map { |i| "user-#{i}@example.com" }
+
+def fresh
+  FastBloomFilter::Filter.new(error_rate: 0.01, initial_capacity: 8192)
+end
+
+puts "#{N} keys"
+puts "method                  total ms   ns/key"
+puts "-" * 42
+
+[
+  ["each { add(k.to_s) }",   ->(f) { keys.each { |k| f.add(k.to_s) } }],
+  ["each { add(k) }",        ->(f) { keys.each { |k| f.add(k) } }],
+  ["add_many(keys)",         ->(f) { f.add_many(keys) }],
+].each do |name, run|
+  f = fresh
+  t = Benchmark.realtime { run.call(f) }
+  printf("%-22s %10.1f %8.1f\n", name, t * 1000, t * 1e9 / N)
+end
@@ -0,0 +1,53 @@
+#!/usr/bin/env ruby
+# Layer count and miss latency under the fixed and adaptive growth
+# policies for a few ingest profiles.
+#
+#   bulk    — one add_many of every key
+#   steady  — batches of 2,000 keys with a pause between them; the
+#             adaptive filters use a 1 s horizon so that the run stays
+#             short (the default is an hour)
+#   hinted  — steady ingest with expected_total: set to the final count
+#
+#   ruby -I lib benchmark/growth_policy.rb
+
+require "fast_bloom_filter"
+require "benchmark"
+
+KEYS    = 1_000_000
+LOOKUPS = 200_000
+
+keys   = KEYS.times.map { |i| "key-#{i}" }
+misses = LOOKUPS.times.map { |i| "miss-#{i}@example.com" }
+
+def steady(bloom, keys)
+  keys.each_slice(2_000) do |batch|
+    bloom.add_many(batch)
+    sleep 0.001
+  end
+end
+
+PROFILES = {
+  "bulk"   => ->(b, k) { b.add_many(k) },
+  "steady" => method(:steady),
+  "hinted" => method(:steady)
+}.freeze
+
+puts "profile  growth      layers        MB   ns/miss"
+puts "-" * 48
+
+PROFILES.each do |name, ingest|
+  [:fixed, :adaptive].each do |growth|
+    opts = { error_rate: 0.01, initial_capacity: 1_000, growth: growth }
+    opts[:growth_horizon] = 1.0 if growth == :adaptive
+    opts[:expected_total] = KEYS if growth == :adaptive && name == "hinted"
+
+    bloom = FastBloomFilter::Filter.new(**opts)
+    ingest.call(bloom, keys)
+
+    misses.each { |k| bloom.include?(k) } # warm up
+    t = Benchmark.realtime { misses.each { |k| bloom.include?(k) } }
+
+    printf("%-8s %-10s %6d %9.1f %9.1f\n", name, growth, bloom.num_layers,
+           bloom.stats[:total_bytes] / 1_048_576.0, t * 1e9 / LOOKUPS)
+  end
+end
@@ -0,0 +1,37 @@
+#!/usr/bin/env ruby
+# Probe latency of a large layer on 4 KB, transparent huge and
+# hugetlb pages.
+#
+# Random probes into a layer far larger than the TLB's reach miss the
+# TLB on almost every lookup; 2 MB pages cover 512x more memory per
+# entry. :hugetlb needs reserved pages (vm.nr_hugepages) and falls
+# back to :transparent otherwise; the "pages" column shows what each
+# filter actually got.
+#
+#   ruby -I lib benchmark/huge_pages.rb [capacity]
+
+require "fast_bloom_filter"
+require "benchmark"
+
+CAPACITY = (ARGV[0] || 50_000_000).to_i
+FILL     = 1_000_000
+LOOKUPS  = 1_000_000
+
+fill   = FILL.times.map { |i| "key-#{i}" }
+misses = LOOKUPS.times.map { |i| "miss-#{i}@example.com" }
+
+puts "huge_pages     pages         MB   ns/probe"
+puts "-" * 42
+
+[false, :transparent, :hugetlb].each do |mode|
+  bloom = FastBloomFilter::Filter.new(error_rate: 0.01, initial_capacity: CAPACITY,
+                                      huge_pages: mode)
+  bloom.add_many(fill) # touch every page of the layer
+
+  layer = bloom.stats[:layers].first
+  bloom.include_many(misses) # warm up
+  t = Benchmark.realtime { 3.times { bloom.include_many(misses) } }
+
+  printf("%-14s %-12s %5d %10.1f\n", mode.inspect, layer[:pages],
+         layer[:size_bytes] >> 20, t * 1e9 / (3 * LOOKUPS))
+end
@@ -0,0 +1,35 @@
+#!/usr/bin/env ruby
+# Add / hit / miss latency of each layer layout on a filter larger than
+# the last-level cache, and delete latency for the counting layout.
+#
+#   ruby -I lib benchmark/layouts.rb
+#   FAST_BLOOM_FILTER_SIMD=scalar ruby -I lib benchmark/layouts.rb
+
+require "fast_bloom_filter"
+require "benchmark"
+
+N       = 2_000_000
+LOOKUPS = 500_000
+
+keys   = N.times.map { |i| "key-#{i}" }
+hits   = keys.sample(LOOKUPS, random: Random.new(1))
+misses = LOOKUPS.times.map { |i| "miss-#{i}" }
+
+puts "SIMD kernel: #{FastBloomFilter::SIMD_KERNEL}"
+puts "layout          MB    ns/add   ns/hit  ns/miss   fpr    ns/delete"
+puts "-" * 69
+
+[:standard, :blocked, :split_block, :counting].each do |layout|
+  bloom = FastBloomFilter::Filter.new(error_rate: 0.01, initial_capacity: N, layout: layout)
+
+  t_add  = Benchmark.realtime { keys.each { |k| bloom.add(k) } }
+  t_hit  = Benchmark.realtime { hits.each { |k| bloom.include?(k) } }
+  fp     = 0
+  t_miss = Benchmark.realtime { misses.each { |k| fp += 1 if bloom.include?(k) } }
+  t_del  = layout == :counting && Benchmark.realtime { hits.each { |k| bloom.delete(k) } }
+
+  printf("%-12s %6.1f %9.1f %8.1f %8.1f  %.4f %12s\n",
+         layout, bloom.stats[:total_bytes] / 1048576.0,
+         t_add * 1e9 / N, t_hit * 1e9 / LOOKUPS, t_miss * 1e9 / LOOKUPS,
+         fp.to_f / LOOKUPS, t_del ? format("%.1f", t_del * 1e9 / LOOKUPS) : "-")
+end
@@ -0,0 +1,39 @@
+#!/usr/bin/env ruby
+# Miss latency of include? as the number of layers grows.
+#
+# Every miss has to probe all layers, so its cost grows with the layer
+# count. Since the key is hashed once per lookup, the per-layer cost is
+# only the bit probes themselves. compact! with the inserted keys
+# folds the filter back into a single layer.
+#
+#   ruby -I lib benchmark/miss_latency.rb
+
+require "fast_bloom_filter"
+require "benchmark"
+
+LOOKUPS = 200_000
+
+misses = LOOKUPS.times.map { |i| "miss-#{i}@example.com" }
+
+puts "layers   elements   ns/miss   compacted"
+puts "-" * 42
+
+[1, 2, 4, 8, 12, 15].each do |target|
+  bloom = FastBloomFilter::Filter.new(error_rate: 0.01, initial_capacity: 256)
+  i = 0
+  while bloom.num_layers < target
+    bloom.add("key-#{i}")
+    i += 1
+  end
+
+  layers = bloom.num_layers
+  misses.each { |k| bloom.include?(k) } # warm up
+  t = Benchmark.realtime { misses.each { |k| bloom.include?(k) } }
+
+  bloom.compact!(i.times.map { |j| "key-#{j}" })
+  misses.each { |k| bloom.include?(k) }
+  tc = Benchmark.realtime { misses.each { |k| bloom.include?(k) } }
+
+  printf("%6d %10d %9.1f %11.1f\n", layers, bloom.count, t * 1e9 / LOOKUPS,
+         tc * 1e9 / LOOKUPS)
+end
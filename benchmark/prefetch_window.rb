@@ -0,0 +1,36 @@
+#!/usr/bin/env ruby
+# Batch throughput against prefetch_window on a filter larger than the
+# last-level cache. Window 1 disables the pipeline.
+#
+#   ruby -I lib benchmark/prefetch_window.rb [N] [layout]
+
+require "fast_bloom_filter"
+require "benchmark"
+
+N       = (ARGV[0] || 20_000_000).to_i
+LAYOUT  = (ARGV[1] || "standard").to_sym
+LOOKUPS = 2_000_000
+
+bloom = FastBloomFilter::Filter.new(error_rate: 0.001, initial_capacity: N, layout: LAYOUT)
+N.times.each_slice(1_000_000) { |s| bloom.add_many(s.map { |i| "key-#{i}" }) }
+
+hits    = LOOKUPS.times.map { |i| "key-#{(i * 7919) % N}" }
+misses  = LOOKUPS.times.map { |i| "miss-#{i}" }
+inserts = LOOKUPS.times.map { |i| "new-#{i}" }
+
+printf("layout=%s  %.1f MB, %d layers\n\n", LAYOUT, bloom.stats[:total_bytes] / 1048576.0, bloom.num_layers)
+puts "window   ns/hit  ns/miss   ns/add"
+puts "-" * 34
+
+[1, 2, 4, 8, 16, 32, 64].each do |w|
+  bloom.prefetch_window = w
+  t_hit  = Benchmark.realtime { bloom.include_many(hits, format: :bitmap) }
+  t_miss = Benchmark.realtime { bloom.include_many(misses, format: :bitmap) }
+
+  target = FastBloomFilter::Filter.new(error_rate: 0.001, initial_capacity: N, layout: LAYOUT,
+                                       prefetch_window: w)
+  t_add  = Benchmark.realtime { target.add_many(inserts) }
+
+  printf("%6d %8.1f %8.1f %8.1f\n", w,
+         t_hit * 1e9 / LOOKUPS, t_miss * 1e9 / LOOKUPS, t_add * 1e9 / LOOKUPS)
+end
@@ -0,0 +1,47 @@
+#!/usr/bin/env ruby
+# Dedup throughput: `include?` followed by `add` (two hashes, two layer
+# sweeps for every new key) against a single `add?`, on a stream where
+# every key appears twice. Best of three runs.
+#
+#   ruby -I lib benchmark/test_and_set.rb
+
+require "fast_bloom_filter"
+require "benchmark"
+
+KEYS = 500_000
+RUNS = 3
+
+stream = KEYS.times.map { |i| "user-#{i}@example.com" }
+stream = (stream + stream).shuffle(random: Random.new(42))
+
+def include_then_add(bloom, stream)
+  unique = 0
+  stream.each do |key|
+    next if bloom.include?(key)
+    bloom.add(key)
+    unique += 1
+  end
+  unique
+end
+
+def test_and_set(bloom, stream)
+  unique = 0
+  stream.each { |key| unique += 1 unless bloom.add?(key) }
+  unique
+end
+
+puts "method           capacity  layers  unique   ns/key"
+puts "-" * 51
+
+[10_000, 1_000_000].each do |capacity|
+  { "include? + add" => :include_then_add, "add?" => :test_and_set }.each do |name, m|
+    best = Float::INFINITY
+    bloom = unique = nil
+    RUNS.times do
+      bloom = FastBloomFilter::Filter.new(error_rate: 0.01, initial_capacity: capacity)
+      best  = [best, Benchmark.realtime { unique = send(m, bloom, stream) }].min
+    end
+    printf("%-15s %9d %7d %7d %8.1f\n", name, capacity, bloom.stats[:num_layers],
+           unique, best * 1e9 / stream.size)
+  end
+end
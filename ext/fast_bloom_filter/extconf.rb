@@ -2,4 +2,26 @@ require 'mkmf'
 
 have_library('m')
 
+# The split-block kernel is compiled for AVX2 via a function-level
+# target attribute and selected at load time, so the gem itself is
+# built without any -m flags and runs on every x86-64 CPU.
+if try_compile(<<~SRC)
+  #include <immintrin.h>
+  __attribute__((target("avx2")))
+  static int probe(void) { return _mm256_testc_si256(_mm256_set1_epi32(1), _mm256_set1_epi32(1)); }
+  int main(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") ? probe() : 0; }
+SRC
+  $defs << '-DHAVE_AVX2_DISPATCH'
+end
+
+# Same for the AVX-512 VPOPCNTDQ popcount kernel used by stats and dumps
+if $defs.include?('-DHAVE_AVX2_DISPATCH') && try_compile(<<~SRC)
+  #include <immintrin.h>
+  __attribute__((target("avx512f,avx512vpopcntdq")))
+  static long probe(const void *p) { return _mm512_reduce_add_epi64(_mm512_popcnt_epi64(_mm512_loadu_si512(p))); }
+  int main(void) { static char b[64]; __builtin_cpu_init(); return __builtin_cpu_supports("avx512vpopcntdq") ? (int)probe(b) : 0; }
+SRC
+  $defs << '-DHAVE_AVX512_POPCNT_DISPATCH'
+end
+
 create_makefile('fast_bloom_filter/fast_bloom_filter')
@@ -14,37 +14,202 @@
  */
 
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/io.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(HAVE_AVX2_DISPATCH) || defined(HAVE_AVX512_POPCNT_DISPATCH)
+#include <immintrin.h>
+#endif
 
 /* ------------------------------------------------------------------ */
 /*  Single Bloom Filter layer                                         */
 /* ------------------------------------------------------------------ */
 
+/* Bit layout of a layer.
+ *   STANDARD — k probes spread over the whole bit array.
+ *   BLOCKED  — the key picks one 64-byte block (one cache line) and
+ *              all k probes land inside it: a miss costs a single
+ *              cache miss, at the price of a slightly higher FPR that
+ *              layer_create() compensates for with extra bits.
+ *   SPLIT_BLOCK — Parquet/Impala SBBF: 32-byte blocks of eight 32-bit
+ *              lanes, one bit per lane, so k is always 8. Add and check
+ *              are a handful of AVX2 instructions when the CPU has it.
+ *   COUNTING — STANDARD probes over 4-bit counters instead of bits (4x
+ *              the memory), so that keys can be deleted. Counters
+ *              saturate at COUNTER_MAX and then never go back down.  */
+enum {
+    LAYOUT_STANDARD    = 0,
+    LAYOUT_BLOCKED     = 1,
+    LAYOUT_SPLIT_BLOCK = 2,
+    LAYOUT_COUNTING    = 3
+};
+
+/* How a hash is reduced to a bit (or block) index.
+ *   EXACT — the layer has exactly the bits the target FPR needs and
+ *           reduces with Lemire's multiply-shift (no division).
+ *   POW2  — the index space is rounded up to a power of two and
+ *           reduced with a mask: spends memory, lowers the FPR.      */
+enum {
+    SIZING_EXACT = 0,
+    SIZING_POW2  = 1
+};
+
+/* Where a layer's bits live.
+ *   HEAP — bits_alloc(), released with free(). Only merge! copies,
+ *          which are built before the receiver's lock is taken.
+ *   ARENA — carved from the filter's slabs (arena_alloc()) and
+ *          released all at once with the filter.
+ *   MMAP — inside a file mapping (Filter.open_mmap). Layers read from
+ *          the file share the filter's mapping; layers a read-write
+ *          filter grows later own a mapping of their own (map/map_len).
+ *   SHARED — inside an anonymous MAP_SHARED region (Filter#share!)
+ *          that forked children inherit instead of copying.        */
+enum {
+    BACKING_HEAP   = 0,
+    BACKING_MMAP   = 1,
+    BACKING_SHARED = 2,
+    BACKING_ARENA  = 3
+};
+
+/* How the next layer's capacity is chosen.
+ *   FIXED — previous capacity times growth_factor(num_layers).
+ *   ADAPTIVE — at least that, but room for the rest of expected_total
+ *          if the caller gave one, otherwise for growth_horizon seconds
+ *          of inserts at the rate the previous layer filled (at most
+ *          ADAPTIVE_MAX_GROWTH times the previous capacity).           */
+enum {
+    GROWTH_FIXED    = 0,
+    GROWTH_ADAPTIVE = 1
+};
+
+/* When the active layer counts as full.
+ *   COUNT — after `capacity` adds, duplicates included.
+ *   FILL — once as many bits are set as `capacity` distinct keys would
+ *          set (at most FILL_RATIO_THRESHOLD of the layer), so that
+ *          re-added keys do not use up the layer.                    */
+enum {
+    ROLLOVER_COUNT = 0,
+    ROLLOVER_FILL  = 1
+};
+
+/* Page size for arena slabs that hold layers of 2 MB or more; smaller
+ * layers always stay on 4 KB pages so that small filters stay small.
+ *   TRANSPARENT — madvise(MADV_HUGEPAGE), the default.
+ *   HUGETLB — MAP_HUGETLB from the reserved pool, falling back to
+ *          TRANSPARENT when the pool is empty.
+ *   NONE — madvise(MADV_NOHUGEPAGE), even under THP "always".
+ * A slab records what it actually got.                              */
+enum {
+    HUGE_PAGES_TRANSPARENT = 0,
+    HUGE_PAGES_HUGETLB     = 1,
+    HUGE_PAGES_NONE        = 2
+};
+
 typedef struct {
     uint8_t *bits;
     size_t   size;        /* bytes */
     size_t   capacity;    /* max elements for this layer */
     size_t   count;       /* elements inserted so far */
     int      num_hashes;
+    int      layout;      /* LAYOUT_* */
+    int      sizing;      /* SIZING_* */
+    size_t   slots;       /* bits (standard) or blocks (blocked layouts) */
+    size_t   slot_mask;   /* slots - 1 for SIZING_POW2, else 0 */
+    size_t   requested_bits; /* bits the target FPR needed before rounding */
+    int      hash64;      /* index space beyond 2^32: probe with 64-bit hashes */
+    int      atomic;      /* concurrent filter: atomic bit sets and count */
+    int      backing;     /* BACKING_* */
+    void    *map;         /* mapping owned by this layer, if any */
+    size_t   map_len;
+    uint8_t *dirty;       /* one bit per 4 KB page changed since the last
+                             checkpoint; NULL unless tracking changes */
+    size_t   bits_set;    /* bits flipped 0 -> 1 by this process, see
+                             layer_bits_set() */
+    size_t   full_bits;   /* ROLLOVER_FILL: bits_set at which the layer is
+                             full; 0 to go by count */
+    size_t   saturated;   /* LAYOUT_COUNTING: counters stuck at COUNTER_MAX,
+                             see layer_saturated() */
 } BloomLayer;
 
+/* A slab of the bit arena with this header in its first cache line:
+ * heap memory below ARENA_SLAB_BYTES, 2 MB aligned anonymous memory
+ * from there on. Slabs are never reused or shrunk.                 */
+typedef struct ArenaSlab {
+    struct ArenaSlab *next;
+    size_t size;    /* bytes allocated */
+    size_t used;    /* bytes handed out, header included */
+    int    pages;   /* HUGE_PAGES_* the slab is backed by */
+    int    mapped;  /* from arena_map(), else bits_alloc() */
+} ArenaSlab;
+
 /* ------------------------------------------------------------------ */
 /*  Scalable Bloom Filter (chain of layers)                           */
 /* ------------------------------------------------------------------ */
 
 typedef struct {
-    BloomLayer **layers;
+    /* Layer headers are stored inline and the array only moves under
+     * the exclusive lock: never keep a BloomLayer pointer across
+     * scalable_add_layer().                                          */
+    BloomLayer *layers;
     size_t  num_layers;
     size_t  layers_cap;      /* allocated slots in layers[] */
+    ArenaSlab *arena;        /* newest slab first */
+    int     huge_pages;      /* HUGE_PAGES_* for large layers */
+    int     growth;          /* GROWTH_* */
+    size_t  expected_total;  /* caller's estimate of all inserts, 0 if none */
+    double  growth_horizon;  /* seconds of inserts an adaptive layer holds */
+    double  layer_started;   /* monotonic time the newest layer was added */
+    int     rollover;        /* ROLLOVER_* */
 
     double  error_rate;      /* user-requested total FPR */
     double  tightening;      /* r — each layer multiplies FPR by this */
     size_t  initial_capacity;
+    int     layout;          /* LAYOUT_* used for new layers */
+    int     sizing;          /* SIZING_* used for new layers */
+    int     hash64;          /* some layer needs the 64-bit hash pair */
+    size_t  prefetch_window; /* keys in flight in batch operations */
+    int     concurrent;      /* writers share the lock, bits set atomically */
+
+    /* Batch operations run without the GVL, so every entry point takes
+     * this lock: shared for lookups, exclusive for anything that writes.
+     * Concurrent filters take it shared for adds too and only go
+     * exclusive to roll over to a new layer.                           */
+    pthread_rwlock_t lock;
 
     size_t  total_count;     /* elements across all layers */
+
+    /* Filter#metrics: since the filter was created or loaded, kept
+     * with relaxed atomics once per call or batch.                   */
+    uint64_t adds;
+    uint64_t lookups;
+    uint64_t positives;
+
+    /* Filter.open_mmap: the file mapping holding the snapshot header,
+     * layer table and the layers that were in the file when opened.  */
+    uint8_t *map;
+    size_t   map_len;
+    size_t   file_len;       /* grows as read-write filters add layers */
+    size_t   map_slots;      /* layer table capacity in the file */
+    int      map_fd;         /* read-write only, -1 otherwise */
+    int      read_only;
+    int      shared;         /* Filter#share!: fixed geometry, no rollover */
+    size_t   shared_published; /* writers: own flips added to the shared fill */
+    size_t   shared_fill;    /* writers: last layer's bits set by everyone,
+                                as last read from the shared header */
+    int      track_changes;  /* layers keep dirty page maps for checkpoint */
+    uint64_t checkpoint_seq; /* checkpoints written or replayed since then */
 } ScalableBloom;
 
 /* ------------------------------------------------------------------ */
@@ -57,6 +222,29 @@ typedef struct {
 #define FILL_RATIO_THRESHOLD    0.5
 #define MAX_HASHES              20
 #define MIN_HASHES              1
+#define BLOCK_BYTES             64     /* one cache line */
+#define BLOCK_BITS              (BLOCK_BYTES * 8)
+#define SBBF_BLOCK_BYTES        32     /* 8 lanes x 32 bits */
+#define SBBF_LANES              8
+#define COUNTER_BITS            4      /* LAYOUT_COUNTING, two per byte */
+#define COUNTER_MAX             15
+#define DEFAULT_PREFETCH_WINDOW 16
+#define MAX_PREFETCH_WINDOW     64
+#define PREFETCH_PROBES         2      /* misses usually stop within 2 probes */
+#define BATCH_CHUNK             1024   /* keys gathered per C batch call */
+#define NOGVL_MIN_KEYS          8192   /* batches this large release the GVL */
+#define NOGVL_CHUNK             65536  /* keys copied per GVL-free call */
+#define DIRTY_PAGE_SHIFT        12     /* checkpoints track 4 KB pages */
+#define DIRTY_PAGE_BYTES        (1 << DIRTY_PAGE_SHIFT)
+#define CHECKPOINT_RUN_PAGES    64     /* dirty pages per checkpoint frame */
+#define DEFAULT_GROWTH_HORIZON  3600.0 /* adaptive layers hold an hour */
+#define ADAPTIVE_MAX_GROWTH     16.0
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BLOOM_PREFETCH(addr, rw) __builtin_prefetch((addr), (rw), 3)
+#else
+#define BLOOM_PREFETCH(addr, rw) ((void)(addr))
+#endif
 
 /* Growth factor: starts at ~2x, approaches 1.25x for large filters.
  * Formula mirrors Go's slice growth strategy.                        */
@@ -113,334 +301,2597 @@ static uint32_t murmur3_32(const uint8_t *key, size_t len, uint32_t seed) {
 }
 
 /* ------------------------------------------------------------------ */
-/*  Bit helpers                                                       */
+/*  MurmurHash3 — x64 128-bit, for layers past 2^32 bits              */
 /* ------------------------------------------------------------------ */
 
-static inline void set_bit(uint8_t *bits, size_t pos) {
-    bits[pos / 8] |= (1 << (pos % 8));
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
 }
 
-static inline int get_bit(const uint8_t *bits, size_t pos) {
-    return (bits[pos / 8] & (1 << (pos % 8))) != 0;
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
 }
 
-/* ------------------------------------------------------------------ */
-/*  Layer lifecycle                                                   */
-/* ------------------------------------------------------------------ */
-
-static BloomLayer *layer_create(size_t capacity, double error_rate) {
-    BloomLayer *layer = (BloomLayer *)calloc(1, sizeof(BloomLayer));
-    if (!layer) return NULL;
-
-    double ln2    = 0.693147180559945309417;
-    double ln2_sq = ln2 * ln2;
+static void murmur3_x64_128(const uint8_t *key, size_t len, uint32_t seed,
+                            uint64_t *out1, uint64_t *out2) {
+    const size_t nblocks = len / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed;
 
-    size_t bits_count = (size_t)(-(double)capacity * log(error_rate) / ln2_sq);
-    if (bits_count < 64) bits_count = 64;  /* sane minimum */
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, key + i * 16, 8);
+        memcpy(&k2, key + i * 16 + 8, 8);
 
-    layer->size      = (bits_count + 7) / 8;
-    layer->capacity  = capacity;
-    layer->count     = 0;
-    layer->num_hashes = (int)((bits_count / (double)capacity) * ln2);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
 
-    if (layer->num_hashes < MIN_HASHES) layer->num_hashes = MIN_HASHES;
-    if (layer->num_hashes > MAX_HASHES) layer->num_hashes = MAX_HASHES;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
 
-    layer->bits = (uint8_t *)calloc(layer->size, sizeof(uint8_t));
-    if (!layer->bits) {
-        free(layer);
-        return NULL;
+    const uint8_t *tail = key + nblocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+
+    switch (len & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+        case 10: k2 ^= (uint64_t)tail[9]  << 8;  /* fall through */
+        case 9:  k2 ^= (uint64_t)tail[8];
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            /* fall through */
+        case 8:  k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+        case 7:  k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+        case 6:  k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+        case 5:  k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+        case 4:  k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+        case 3:  k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+        case 2:  k1 ^= (uint64_t)tail[1] << 8;  /* fall through */
+        case 1:  k1 ^= (uint64_t)tail[0];
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
     }
 
-    return layer;
+    h1 ^= len; h2 ^= len;
+    h1 += h2;  h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;  h2 += h1;
+
+    *out1 = h1;
+    *out2 = h2;
 }
 
-static void layer_free(BloomLayer *layer) {
-    if (layer) {
-        free(layer->bits);
-        free(layer);
-    }
+/* Kirsch–Mitzenmacher: 2 hashes instead of k. The pair depends only
+ * on the key, so it is computed once per operation and shared by
+ * every layer instead of being recomputed per layer. The 64-bit pair
+ * is only computed while some layer is too large for 32-bit indexes. */
+typedef struct {
+    uint32_t h1;
+    uint32_t h2;
+    uint64_t g1;
+    uint64_t g2;
+} BloomHash;
+
+static inline void bloom_hash(BloomHash *h, const char *data, size_t len, int hash64) {
+    h->h1 = murmur3_32((const uint8_t *)data, len, 0x9747b28c);
+    h->h2 = murmur3_32((const uint8_t *)data, len, 0x5bd1e995);
+    if (hash64)
+        murmur3_x64_128((const uint8_t *)data, len, 0x9747b28c, &h->g1, &h->g2);
 }
 
-static inline int layer_is_full(const BloomLayer *layer) {
-    return layer->count >= layer->capacity;
+/* ------------------------------------------------------------------ */
+/*  Bit helpers                                                       */
+/* ------------------------------------------------------------------ */
+
+/* Both setters return 1 when the bit was clear before */
+static inline int set_bit(uint8_t *bits, size_t pos) {
+    uint8_t mask = (uint8_t)(1U << (pos % 8));
+    uint8_t old  = bits[pos / 8];
+    bits[pos / 8] = old | mask;
+    return !(old & mask);
 }
 
-static void layer_add(BloomLayer *layer, const char *data, size_t len) {
-    size_t bits_count = layer->size * 8;
+static inline int get_bit(const uint8_t *bits, size_t pos) {
+    return (bits[pos / 8] & (1 << (pos % 8))) != 0;
+}
 
-    /* Kirsch–Mitzenmacher: 2 hashes instead of k */
-    uint32_t h1 = murmur3_32((const uint8_t *)data, len, 0x9747b28c);
-    uint32_t h2 = murmur3_32((const uint8_t *)data, len, 0x5bd1e995);
+/* Concurrent filters set bits with a fetch-or on the containing 64-bit
+ * word. Bit `pos` lives in byte pos / 8 at bit pos % 8; on little-endian
+ * machines that is bit pos % 64 of word pos / 64, elsewhere fall back
+ * to a byte-wide fetch-or.                                             */
+static inline int set_bit_atomic(uint8_t *bits, size_t pos) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t mask = (uint64_t)1 << (pos % 64);
+    return !(__atomic_fetch_or((uint64_t *)bits + pos / 64, mask, __ATOMIC_RELAXED) & mask);
+#else
+    uint8_t mask = (uint8_t)(1U << (pos % 8));
+    return !(__atomic_fetch_or(bits + pos / 8, mask, __ATOMIC_RELAXED) & mask);
+#endif
+}
 
-    for (int i = 0; i < layer->num_hashes; i++) {
-        uint32_t combined = h1 + (uint32_t)i * h2;
-        set_bit(layer->bits, combined % bits_count);
-    }
-    layer->count++;
+/* Counter `pos` of a counting layer is the low (even pos) or high
+ * nibble of byte pos / 2. The steppers return the old value; a counter
+ * at COUNTER_MAX has lost count of its keys and is left alone.       */
+static inline unsigned counter_get(const uint8_t *counters, size_t pos) {
+    return (counters[pos / 2] >> (pos % 2 * COUNTER_BITS)) & COUNTER_MAX;
 }
 
-static int layer_include(const BloomLayer *layer, const char *data, size_t len) {
-    size_t bits_count = layer->size * 8;
+static inline unsigned counter_inc(uint8_t *counters, size_t pos) {
+    unsigned old = counter_get(counters, pos);
+    if (old < COUNTER_MAX) counters[pos / 2] += (uint8_t)(1U << (pos % 2 * COUNTER_BITS));
+    return old;
+}
 
-    /* Kirsch–Mitzenmacher: 2 hashes instead of k */
-    uint32_t h1 = murmur3_32((const uint8_t *)data, len, 0x9747b28c);
-    uint32_t h2 = murmur3_32((const uint8_t *)data, len, 0x5bd1e995);
+static inline unsigned counter_dec(uint8_t *counters, size_t pos) {
+    unsigned old = counter_get(counters, pos);
+    if (old > 0 && old < COUNTER_MAX) counters[pos / 2] -= (uint8_t)(1U << (pos % 2 * COUNTER_BITS));
+    return old;
+}
 
-    for (int i = 0; i < layer->num_hashes; i++) {
-        uint32_t combined = h1 + (uint32_t)i * h2;
-        if (!get_bit(layer->bits, combined % bits_count))
-            return 0;
+/* Concurrent and shared filters: a compare-and-swap on the byte, which
+ * the neighbouring counter may be changing at the same time.         */
+static inline unsigned counter_step_atomic(uint8_t *counters, size_t pos, int up) {
+    uint8_t *p     = counters + pos / 2;
+    unsigned shift = pos % 2 * COUNTER_BITS;
+    uint8_t  cur   = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    for (;;) {
+        unsigned old = (cur >> shift) & COUNTER_MAX;
+        if (old == COUNTER_MAX || (!up && old == 0)) return old;
+        uint8_t next = up ? (uint8_t)(cur + (1U << shift)) : (uint8_t)(cur - (1U << shift));
+        if (__atomic_compare_exchange_n(p, &cur, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return old;
     }
-    return 1;
 }
 
-static size_t layer_bits_set(const BloomLayer *layer) {
+static inline unsigned counter_inc_atomic(uint8_t *counters, size_t pos) {
+    return counter_step_atomic(counters, pos, 1);
+}
+
+static inline unsigned counter_dec_atomic(uint8_t *counters, size_t pos) {
+    return counter_step_atomic(counters, pos, 0);
+}
+
+/* Non-zero counters (or, with `saturated`, counters at COUNTER_MAX) in
+ * n bytes, sixteen at a time: OR (AND) the four bits of every nibble
+ * into its lowest bit and count those.                               */
+static size_t counters_count(const uint8_t *p, size_t n, int saturated) {
+    const uint64_t low = 0x1111111111111111ULL;
     size_t count = 0;
-    for (size_t i = 0; i < layer->size; i++) {
-        uint8_t b = layer->bits[i];
-        while (b) { count += b & 1; b >>= 1; }
+
+    for (size_t i = 0; i < n; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, n - i < 8 ? n - i : 8);
+        uint64_t t = saturated ? w & (w >> 1) : w | (w >> 1);
+        t = saturated ? t & (t >> 2) : t | (t >> 2);
+        count += (size_t)__builtin_popcountll(t & low);
     }
     return count;
 }
 
-/* ------------------------------------------------------------------ */
-/*  Scalable filter helpers                                           */
-/* ------------------------------------------------------------------ */
+static size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
 
-/* Error rate for the i-th layer (0-indexed):
- *   layer_fpr(i) = error_rate * (1 - r) * r^i
- * Sum converges to error_rate.                                       */
-static double layer_error_rate(double total_fpr, double r, size_t index) {
-    return total_fpr * (1.0 - r) * pow(r, (double)index);
+/* Zeroed, cache-line aligned bit array so that blocks never straddle
+ * two cache lines. The allocation is padded to whole 64-bit words for
+ * set_bit_atomic(). Released with plain free().                        */
+static uint8_t *bits_alloc(size_t size) {
+    size_t padded = (size + 7) & ~(size_t)7;
+    void  *p      = NULL;
+    if (posix_memalign(&p, BLOCK_BYTES, padded) != 0) return NULL;
+    memset(p, 0, padded);
+    return (uint8_t *)p;
 }
 
-static BloomLayer *scalable_add_layer(ScalableBloom *sb) {
-    size_t new_cap;
-    if (sb->num_layers == 0) {
-        new_cap = sb->initial_capacity;
-    } else {
-        double gf = growth_factor(sb->num_layers);
-        new_cap = (size_t)(sb->layers[sb->num_layers - 1]->capacity * gf);
+/* Layers of a filter share a few slabs instead of one allocation
+ * each, and every array starts on a cache line. Slabs at least double
+ * in size: a small filter's first slab is 1 KB from the heap, so
+ * that thousands of small filters do not take a mapping each. From
+ * ARENA_SLAB_BYTES on, slabs are 2 MB aligned mappings that the kernel
+ * can back with huge pages; fresh anonymous pages are already zero.  */
+#define ARENA_SLAB_BYTES ((size_t)2 << 20)
+#define ARENA_MIN_SLAB   ((size_t)1 << 10)
+
+/* madvise(MADV_HUGEPAGE) succeeds even when THP is "never", so the
+ * mode is read once in Init_fast_bloom_filter(): without it slabs are
+ * reported as normal pages. A kernel without the file has no THP and
+ * fails the madvise anyway.                                          */
+static int thp_enabled = 1;
+
+static void thp_detect(void) {
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!f) return;
+    char mode[128];
+    if (fgets(mode, sizeof mode, f) && strstr(mode, "[never]"))
+        thp_enabled = 0;
+    fclose(f);
+}
+
+static void *arena_map(size_t len, int huge_pages, int *pages) {
+#ifdef MAP_HUGETLB
+    if (huge_pages == HUGE_PAGES_HUGETLB) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        void *h = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (h != MAP_FAILED) {
+            *pages = HUGE_PAGES_HUGETLB;
+            return h;
+        }
+        huge_pages = HUGE_PAGES_TRANSPARENT;
     }
+#endif
+
+    size_t   span = len + ARENA_SLAB_BYTES;
+    uint8_t *p    = (uint8_t *)mmap(NULL, span, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    uint8_t *base = (uint8_t *)(((uintptr_t)p + ARENA_SLAB_BYTES - 1) &
+                                ~(uintptr_t)(ARENA_SLAB_BYTES - 1));
+    if (base > p) munmap(p, (size_t)(base - p));
+    if (p + span > base + len) munmap(base + len, (size_t)(p + span - (base + len)));
+
+    *pages = HUGE_PAGES_NONE;
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    if (huge_pages != HUGE_PAGES_NONE && madvise(base, len, MADV_HUGEPAGE) == 0)
+        *pages = thp_enabled ? HUGE_PAGES_TRANSPARENT : HUGE_PAGES_NONE;
+    else
+        madvise(base, len, MADV_NOHUGEPAGE);
+#endif
+    return base;
+}
 
-    double fpr = layer_error_rate(sb->error_rate, sb->tightening, sb->num_layers);
-    if (fpr < 1e-15) fpr = 1e-15;  /* floor to avoid log(0) */
+/* Zeroed, cache-line aligned bytes owned by the filter. Callers hold
+ * the exclusive lock (or own a filter nobody else can see yet).      */
+static uint8_t *arena_alloc(ScalableBloom *sb, size_t size) {
+    if (size > SIZE_MAX / 2) return NULL;
+    size = (size + BLOCK_BYTES - 1) & ~(size_t)(BLOCK_BYTES - 1);
+
+    ArenaSlab *slab = sb->arena;
+    if (!slab || slab->size - slab->used < size) {
+        size_t len   = next_pow2(size + BLOCK_BYTES);
+        int    pages = HUGE_PAGES_NONE;
+        if (slab && len < 2 * slab->size) len = 2 * slab->size;
+        if (len < ARENA_MIN_SLAB) len = ARENA_MIN_SLAB;
+
+        if (len < ARENA_SLAB_BYTES) {
+            slab = (ArenaSlab *)bits_alloc(len);
+            if (!slab) return NULL;
+            slab->mapped = 0;
+        } else {
+            len = (size + BLOCK_BYTES + ARENA_SLAB_BYTES - 1) & ~(ARENA_SLAB_BYTES - 1);
+            int huge = size >= ARENA_SLAB_BYTES ? sb->huge_pages : HUGE_PAGES_NONE;
+            slab = (ArenaSlab *)arena_map(len, huge, &pages);
+            if (!slab) return NULL;
+            slab->mapped = 1;
+        }
+        slab->pages = pages;
+        slab->next  = sb->arena;
+        slab->size  = len;
+        slab->used  = BLOCK_BYTES;
+        sb->arena   = slab;
+    }
+
+    uint8_t *p = (uint8_t *)slab + slab->used;
+    slab->used += size;
+    return p;
+}
 
-    BloomLayer *layer = layer_create(new_cap, fpr);
-    if (!layer) return NULL;
+/* HUGE_PAGES_* backing bits from the arena */
+static int arena_pages(const ScalableBloom *sb, const uint8_t *bits) {
+    for (const ArenaSlab *slab = sb->arena; slab; slab = slab->next) {
+        if (bits >= (const uint8_t *)slab && bits < (const uint8_t *)slab + slab->size)
+            return slab->pages;
+    }
+    return HUGE_PAGES_NONE;
+}
 
-    /* Grow layers array if needed */
-    if (sb->num_layers >= sb->layers_cap) {
-        size_t new_slots = sb->layers_cap == 0 ? 4 : sb->layers_cap * 2;
-        BloomLayer **tmp = (BloomLayer **)realloc(sb->layers,
-                                                   new_slots * sizeof(BloomLayer *));
-        if (!tmp) { layer_free(layer); return NULL; }
-        sb->layers     = tmp;
-        sb->layers_cap = new_slots;
+static void arena_free(ScalableBloom *sb) {
+    while (sb->arena) {
+        ArenaSlab *next = sb->arena->next;
+        if (sb->arena->mapped) munmap(sb->arena, sb->arena->size);
+        else                   free(sb->arena);
+        sb->arena = next;
     }
+}
+
+/* Map a 32-bit hash onto [0, n) without a division (Lemire). */
+static inline size_t fastrange32(uint32_t h, size_t n) {
+    return (size_t)(((uint64_t)h * (uint64_t)n) >> 32);
+}
 
-    sb->layers[sb->num_layers++] = layer;
-    return layer;
+static inline size_t fastrange64(uint64_t h, size_t n) {
+#ifdef __SIZEOF_INT128__
+    return (size_t)(((unsigned __int128)h * (unsigned __int128)n) >> 64);
+#else
+    return (size_t)(h % n);
+#endif
 }
 
 /* ------------------------------------------------------------------ */
-/*  Ruby GC integration                                               */
+/*  Layer lifecycle                                                   */
 /* ------------------------------------------------------------------ */
 
-static void bloom_free_scalable(void *ptr) {
-    ScalableBloom *sb = (ScalableBloom *)ptr;
-    for (size_t i = 0; i < sb->num_layers; i++) {
-        layer_free(sb->layers[i]);
+/* Expected FPR of a blocked layer holding n keys: keys per block are
+ * Poisson distributed, and a block holding j keys behaves like a tiny
+ * filter whose `lanes` words of lane_bits bits each receive k / lanes
+ * probes per key (blocked: one 512-bit lane, split-block: eight 32-bit
+ * lanes). Overloaded blocks dominate, which is why blocked layers need
+ * more bits than the textbook formula.                               */
+static double blocked_fpr(size_t bits_count, size_t n, int k,
+                          size_t block_bits, size_t lanes) {
+    double lane_bits = (double)(block_bits / lanes);
+    double per_lane  = (double)k / (double)lanes;
+    double lambda    = (double)n * block_bits / (double)bits_count;
+    double p         = exp(-lambda);   /* Poisson P(j = 0) */
+    double fpr       = 0.0;
+    size_t j_max     = (size_t)(lambda + 10.0 * sqrt(lambda) + 10.0);
+
+    for (size_t j = 0; j <= j_max; j++) {
+        double fill = 1.0 - pow(1.0 - 1.0 / lane_bits, (double)j * per_lane);
+        fpr += p * pow(fill, (double)k);
+        p   *= lambda / (double)(j + 1);
     }
-    free(sb->layers);
-    free(sb);
+    return fpr;
 }
 
-static size_t bloom_memsize_scalable(const void *ptr) {
-    const ScalableBloom *sb = (const ScalableBloom *)ptr;
-    size_t total = sizeof(ScalableBloom);
-    total += sb->layers_cap * sizeof(BloomLayer *);
-    for (size_t i = 0; i < sb->num_layers; i++) {
-        total += sizeof(BloomLayer) + sb->layers[i]->size;
+static size_t layer_block_bits(int layout) {
+    switch (layout) {
+    case LAYOUT_BLOCKED:     return BLOCK_BITS;
+    case LAYOUT_SPLIT_BLOCK: return SBBF_BLOCK_BYTES * 8;
+    default:                 return 1;
     }
-    return total;
 }
 
-static const rb_data_type_t scalable_bloom_type = {
-    "ScalableBloomFilter",
-    {NULL, bloom_free_scalable, bloom_memsize_scalable},
-    NULL, NULL,
-    RUBY_TYPED_FREE_IMMEDIATELY
-};
+/* Bits of the array one slot takes: a bit, a counter or a block */
+static size_t layer_slot_bits(int layout) {
+    return layout == LAYOUT_COUNTING ? COUNTER_BITS : layer_block_bits(layout);
+}
 
-/* ------------------------------------------------------------------ */
-/*  Ruby methods                                                      */
-/* ------------------------------------------------------------------ */
+/* Bytes of an array of `slots` bits, counters or blocks */
+static size_t layer_array_bytes(int layout, size_t slots) {
+    return slots * layer_slot_bits(layout) / 8;
+}
 
-static VALUE bloom_alloc(VALUE klass) {
-    ScalableBloom *sb = (ScalableBloom *)calloc(1, sizeof(ScalableBloom));
-    if (!sb) rb_raise(rb_eNoMemError, "failed to allocate ScalableBloom");
+/* m of the FPR formulas: bits, or counters of a counting layer */
+static inline size_t layer_filter_bits(const BloomLayer *layer) {
+    return layer->slots * layer_block_bits(layer->layout);
+}
 
-    return TypedData_Wrap_Struct(klass, &scalable_bloom_type, sb);
+/* FPR of the layer holding n keys, given its actual geometry (so it
+ * reflects any power-of-two rounding).                               */
+static double layer_fpr_at(const BloomLayer *layer, size_t n) {
+    size_t bits = layer_filter_bits(layer);
+    int    k    = layer->num_hashes;
+
+    switch (layer->layout) {
+    case LAYOUT_BLOCKED:
+        return blocked_fpr(bits, n, k, BLOCK_BITS, 1);
+    case LAYOUT_SPLIT_BLOCK:
+        return blocked_fpr(bits, n, k, SBBF_BLOCK_BYTES * 8, SBBF_LANES);
+    default:
+        return pow(1.0 - exp(-(double)k * n / (double)bits), (double)k);
+    }
 }
 
-/*
- * call-seq:
- *   Filter.new                                  # defaults: error_rate 0.01, initial_capacity 1024
- *   Filter.new(error_rate: 0.001)
- *   Filter.new(error_rate: 0.01, initial_capacity: 10_000)
- *
- * No upfront capacity needed — the filter grows automatically.
- *
- * Ruby 2.7+ compatible: keyword arguments are parsed manually from
- * a trailing Hash argument. The rb_scan_args ":" format requires
- * Ruby 3.2+, so we handle it ourselves for broad compatibility.
- */
-static VALUE bloom_initialize(int argc, VALUE *argv, VALUE self) {
-    VALUE opts = Qnil;
+/* FPR the layer will have once it holds `capacity` keys */
+static double layer_expected_fpr(const BloomLayer *layer) {
+    return layer_fpr_at(layer, layer->capacity);
+}
 
-    if (argc == 0) {
-        /* Filter.new — all defaults */
-    } else if (argc == 1 && RB_TYPE_P(argv[0], T_HASH)) {
-        /* Filter.new(error_rate: 0.01, ...) — keyword args as hash */
-        opts = argv[0];
+/* Geometry for a layer holding `capacity` elements at `error_rate`;
+ * everything but the bit array itself.                               */
+static void layer_geometry(BloomLayer *layer, size_t capacity, double error_rate,
+                           int layout, int sizing) {
+    double ln2    = 0.693147180559945309417;
+    double ln2_sq = ln2 * ln2;
+
+    size_t bits_count = (size_t)(-(double)capacity * log(error_rate) / ln2_sq);
+    if (bits_count < 64) bits_count = 64;  /* sane minimum */
+
+    layer->capacity  = capacity;
+    layer->count     = 0;
+    layer->layout    = layout;
+    layer->sizing    = sizing;
+    layer->num_hashes = (int)((bits_count / (double)capacity) * ln2);
+
+    if (layer->num_hashes < MIN_HASHES) layer->num_hashes = MIN_HASHES;
+    if (layer->num_hashes > MAX_HASHES) layer->num_hashes = MAX_HASHES;
+
+    if (layout == LAYOUT_BLOCKED || layout == LAYOUT_SPLIT_BLOCK) {
+        /* Whole blocks only, then grow until the blocked FPR meets the
+         * layer's target (typically +10-30% bits for :blocked).        */
+        size_t block_bits = layer_block_bits(layout), lanes = 1;
+        if (layout == LAYOUT_SPLIT_BLOCK) {
+            lanes             = SBBF_LANES;
+            layer->num_hashes = SBBF_LANES;
+        }
+
+        bits_count = (bits_count + block_bits - 1) / block_bits * block_bits;
+        while (blocked_fpr(bits_count, capacity, layer->num_hashes, block_bits, lanes) > error_rate)
+            bits_count += (bits_count / 32 + block_bits - 1) / block_bits * block_bits;
     } else {
-        rb_raise(rb_eArgError,
-                 "wrong number of arguments (given %d, expected 0 or keyword arguments)",
-                 argc);
+        bits_count = (bits_count + 7) / 8 * 8;
     }
 
-    double error_rate       = DEFAULT_ERROR_RATE;
-    size_t initial_capacity = DEFAULT_INITIAL_CAP;
-    double tightening       = DEFAULT_TIGHTENING;
+    layer->requested_bits = bits_count;
+    layer->slots          = bits_count / layer_block_bits(layout);
+    if (sizing == SIZING_POW2) {
+        layer->slots     = next_pow2(layer->slots);
+        layer->slot_mask = layer->slots - 1;
+    }
 
-    if (!NIL_P(opts)) {
-        VALUE v;
+    layer->size   = layer_array_bytes(layout, layer->slots);
+    layer->hash64 = layer->slots > (size_t)UINT32_MAX;
+}
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("error_rate")));
-        if (!NIL_P(v)) error_rate = NUM2DBL(v);
+static int layer_create(ScalableBloom *sb, BloomLayer *layer, size_t capacity,
+                        double error_rate) {
+    memset(layer, 0, sizeof(*layer));
+    layer_geometry(layer, capacity, error_rate, sb->layout, sb->sizing);
+    layer->bits    = arena_alloc(sb, layer->size);
+    layer->backing = BACKING_ARENA;
+    return layer->bits ? 0 : -1;
+}
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("initial_capacity")));
-        if (!NIL_P(v)) initial_capacity = (size_t)NUM2LONG(v);
+static inline size_t layer_pages(const BloomLayer *layer) {
+    return (layer->size + DIRTY_PAGE_BYTES - 1) >> DIRTY_PAGE_SHIFT;
+}
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("tightening")));
-        if (!NIL_P(v)) tightening = NUM2DBL(v);
+static inline size_t layer_dirty_bytes(const BloomLayer *layer) {
+    return (layer_pages(layer) + 7) / 8;
+}
+
+/* Starts (or restarts) change tracking with every page clean */
+static int layer_track_changes(BloomLayer *layer) {
+    if (layer->dirty) {
+        memset(layer->dirty, 0, layer_dirty_bytes(layer));
+        return 0;
     }
+    layer->dirty = bits_alloc(layer_dirty_bytes(layer));
+    return layer->dirty ? 0 : -1;
+}
 
-    if (error_rate <= 0 || error_rate >= 1)
-        rb_raise(rb_eArgError, "error_rate must be between 0 and 1 (exclusive)");
-    if (initial_capacity == 0)
-        rb_raise(rb_eArgError, "initial_capacity must be positive");
-    if (tightening <= 0 || tightening >= 1)
-        rb_raise(rb_eArgError, "tightening must be between 0 and 1 (exclusive)");
+/* Frees what the layer owns; arena bits go with the filter's slabs */
+static void layer_release(BloomLayer *layer) {
+    free(layer->dirty);
+    if (layer->backing == BACKING_HEAP)
+        free(layer->bits);
+    else if (layer->map)
+        munmap(layer->map, layer->map_len);
+}
 
-    ScalableBloom *sb;
-    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+static inline int layer_is_full(const BloomLayer *layer) {
+    if (layer->full_bits) return layer->bits_set >= layer->full_bits;
+    return layer->count >= layer->capacity;
+}
 
-    sb->error_rate       = error_rate;
-    sb->initial_capacity = initial_capacity;
-    sb->tightening       = tightening;
-    sb->total_count      = 0;
+/* Whether n more adds could fill the layer */
+static inline int layer_may_fill(const BloomLayer *layer, size_t n) {
+    if (layer->full_bits) return layer->bits_set + n * (size_t)layer->num_hashes >= layer->full_bits;
+    return layer->count + n >= layer->capacity;
+}
 
-    /* Create first layer */
-    if (!scalable_add_layer(sb))
-        rb_raise(rb_eNoMemError, "failed to allocate initial layer");
+/* Bits `capacity` distinct keys are expected to set: 1 - e^(-kn/m) of
+ * the layer, capped at FILL_RATIO_THRESHOLD.                          */
+static size_t layer_fill_limit(const BloomLayer *layer) {
+    double bits = (double)layer_filter_bits(layer);
+    double fill = 1.0 - exp(-(double)layer->num_hashes * (double)layer->capacity / bits);
+    if (fill > FILL_RATIO_THRESHOLD) fill = FILL_RATIO_THRESHOLD;
+    size_t limit = (size_t)(fill * bits);
+    return limit > 0 ? limit : 1;
+}
 
-    return self;
+/* Swamidass–Baldi: n = -m/k * ln(1 - X/m) distinct keys set X of m
+ * bits. Never more than the adds the layer has seen.                 */
+static double layer_cardinality(const BloomLayer *layer, size_t bits_set) {
+    double m = (double)layer_filter_bits(layer);
+    double x = (double)bits_set;
+    if (x >= m) x = m - 0.5;
+    double n = -m / layer->num_hashes * log1p(-x / m);
+    return n < (double)layer->count ? n : (double)layer->count;
 }
 
-/*
- * call-seq:
- *   filter.add("element")
- *   filter << "element"
- */
-static VALUE bloom_add(VALUE self, VALUE str) {
-    ScalableBloom *sb;
-    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+/* Blocked layout: h1 selects the block; probe i multiplies h2 by its
+ * own odd salt and keeps the top 9 bits, addressing one of the block's
+ * 512 bits. Stepping h2 + i*stride instead would make probe patterns
+ * of different keys overlap and roughly quadruple the FPR at 1e-4.
+ * The first eight salts are the ones used by Parquet's SBBF.         */
+static const uint32_t block_salts[MAX_HASHES] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    0x9e3779b1U, 0x85ebca6bU, 0xc2b2ae35U, 0x27d4eb2fU,
+    0x165667b1U, 0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U,
+    0x7feb352dU, 0x846ca68bU, 0x9e485565U, 0xef1d6b47U
+};
 
-    Check_Type(str, T_STRING);
+/* Bit index (standard) or block index (blocked layouts) for a hash:
+ * a mask for power-of-two layers, multiply-shift otherwise.          */
+static inline size_t layer_slot(const BloomLayer *layer, uint64_t h) {
+    if (layer->slot_mask) return (size_t)(h & layer->slot_mask);
+    return layer->hash64 ? fastrange64(h, layer->slots)
+                         : fastrange32((uint32_t)h, layer->slots);
+}
 
-    BloomLayer *active = sb->layers[sb->num_layers - 1];
+/* Blocked layouts pick the block with the first hash of the pair and
+ * place bits inside it with (32 bits of) the second.                 */
+static inline size_t layer_block_slot(const BloomLayer *layer, const BloomHash *h) {
+    return layer_slot(layer, layer->hash64 ? h->g1 : h->h1);
+}
 
-    /* Grow if current layer is full */
-    if (layer_is_full(active)) {
-        active = scalable_add_layer(sb);
-        if (!active)
-            rb_raise(rb_eNoMemError, "failed to allocate new layer");
-    }
+static inline uint32_t layer_block_key(const BloomLayer *layer, const BloomHash *h) {
+    return layer->hash64 ? (uint32_t)h->g2 : h->h2;
+}
 
-    layer_add(active, RSTRING_PTR(str), RSTRING_LEN(str));
-    sb->total_count++;
+static inline uint8_t *layer_block(const BloomLayer *layer, const BloomHash *h) {
+    return layer->bits + layer_block_slot(layer, h) * BLOCK_BYTES;
+}
 
-    return Qtrue;
+static inline size_t block_bit(uint32_t key, int i) {
+    return (key * block_salts[i]) >> 23;
 }
 
-/*
- * call-seq:
- *   filter.include?("element")   #=> true / false
- *   filter.member?("element")    #=> true / false
- *
- * Checks all layers. Returns true if ANY layer says "possibly yes".
- */
-static VALUE bloom_include(VALUE self, VALUE str) {
-    ScalableBloom *sb;
-    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+/* Bit (or counter) index of probe i in standard and counting layers.
+ * Under a mask an even step would only reach every other slot (every
+ * fourth for a multiple of 4, ...), so pow2 layers step by an odd one. */
+static inline size_t layer_probe(const BloomLayer *layer, const BloomHash *h, int i) {
+    uint32_t odd = layer->slot_mask != 0;
+    return layer->hash64 ? layer_slot(layer, h->g1 + (uint64_t)i * (h->g2 | odd))
+                         : layer_slot(layer, h->h1 + (uint32_t)i * (h->h2 | odd));
+}
 
-    Check_Type(str, T_STRING);
+/* ------------------------------------------------------------------ */
+/*  Split-block kernels (runtime dispatched)                          */
+/* ------------------------------------------------------------------ */
 
-    const char *data = RSTRING_PTR(str);
-    size_t len       = RSTRING_LEN(str);
+/* Lane i of the key's mask gets bit (key * salt[i]) >> 27. Adds
+ * return how many lanes had that bit clear.                          */
+static int sbbf_add_scalar(uint32_t *block, uint32_t key) {
+    int fresh = 0;
+    for (int i = 0; i < SBBF_LANES; i++) {
+        uint32_t mask = 1U << ((key * block_salts[i]) >> 27);
+        fresh += !(block[i] & mask);
+        block[i] |= mask;
+    }
+    return fresh;
+}
 
-    /* Check from newest to oldest — most elements are in recent layers */
-    for (size_t i = sb->num_layers; i > 0; i--) {
-        if (layer_include(sb->layers[i - 1], data, len))
-            return Qtrue;
+static int sbbf_check_scalar(const uint32_t *block, uint32_t key) {
+    for (int i = 0; i < SBBF_LANES; i++) {
+        if (!(block[i] & (1U << ((key * block_salts[i]) >> 27))))
+            return 0;
     }
+    return 1;
+}
 
-    return Qfalse;
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static inline __m256i sbbf_mask_avx2(uint32_t key) {
+    const __m256i salts = _mm256_setr_epi32(
+        (int)0x47b6137bU, (int)0x44974d91U, (int)0x8824ad5bU, (int)0xa2b7289dU,
+        (int)0x705495c7U, (int)0x2df1424bU, (int)0x9efc4947U, (int)0x5c6bfb31U);
+    __m256i k = _mm256_mullo_epi32(_mm256_set1_epi32((int)key), salts);
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), _mm256_srli_epi32(k, 27));
 }
 
-/*
- * Reset all layers, keep only one fresh layer.
- */
-static VALUE bloom_clear(VALUE self) {
-    ScalableBloom *sb;
-    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+__attribute__((target("avx2,popcnt")))
+static int sbbf_add_avx2(uint32_t *block, uint32_t key) {
+    __m256i *b    = (__m256i *)block;
+    __m256i  old  = _mm256_load_si256(b);
+    __m256i  mask = sbbf_mask_avx2(key);
+    _mm256_store_si256(b, _mm256_or_si256(old, mask));
 
-    for (size_t i = 0; i < sb->num_layers; i++) {
-        layer_free(sb->layers[i]);
+    __m256i clear = _mm256_cmpeq_epi32(_mm256_and_si256(old, mask), _mm256_setzero_si256());
+    return __builtin_popcount((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(clear)));
+}
+
+__attribute__((target("avx2")))
+static int sbbf_check_avx2(const uint32_t *block, uint32_t key) {
+    /* testc: 1 when every mask bit is also set in the block */
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block),
+                              sbbf_mask_avx2(key));
+}
+#endif
+
+/* Concurrent filters: a vector store could drop another writer's bits */
+static int sbbf_add_atomic(uint32_t *block, uint32_t key) {
+    int fresh = 0;
+    for (int i = 0; i < SBBF_LANES; i++) {
+        uint32_t mask = 1U << ((key * block_salts[i]) >> 27);
+        fresh += !(__atomic_fetch_or(&block[i], mask, __ATOMIC_RELAXED) & mask);
     }
-    sb->num_layers  = 0;
-    sb->total_count = 0;
+    return fresh;
+}
 
-    if (!scalable_add_layer(sb))
-        rb_raise(rb_eNoMemError, "failed to allocate layer after clear");
+/* Selected once in Init_fast_bloom_filter() */
+static int  (*sbbf_add)(uint32_t *, uint32_t)         = sbbf_add_scalar;
+static int  (*sbbf_check)(const uint32_t *, uint32_t) = sbbf_check_scalar;
+static const char *sbbf_kernel = "scalar";
+
+static void sbbf_select_kernel(void) {
+#ifdef HAVE_AVX2_DISPATCH
+    const char *force = getenv("FAST_BLOOM_FILTER_SIMD");
+    if (force && strcmp(force, "scalar") == 0) return;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sbbf_add    = sbbf_add_avx2;
+        sbbf_check  = sbbf_check_avx2;
+        sbbf_kernel = "avx2";
+    }
+#endif
+}
 
-    return Qnil;
+/* ------------------------------------------------------------------ */
+/*  Popcount kernels (runtime dispatched)                             */
+/* ------------------------------------------------------------------ */
+
+static size_t popcount_scalar(const uint8_t *p, size_t n) {
+    size_t count = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        count += (size_t)__builtin_popcountll(w);
+    }
+    for (; i < n; i++) count += (size_t)__builtin_popcount(p[i]);
+    return count;
 }
 
-/*
- * Detailed statistics for the whole filter and each layer.
+#ifdef HAVE_AVX2_DISPATCH
+/* The same loop with the popcnt instruction instead of libgcc's */
+__attribute__((target("popcnt")))
+static size_t popcount_popcnt(const uint8_t *p, size_t n) {
+    size_t count = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        count += (size_t)__builtin_popcountll(w);
+    }
+    for (; i < n; i++) count += (size_t)__builtin_popcount(p[i]);
+    return count;
+}
+
+/* Nibble lookup with vpshufb (Mula). Byte counters grow by at most 8
+ * per vector, so they are widened with vpsadbw every 31 vectors.      */
+__attribute__((target("avx2,popcnt")))
+static size_t popcount_avx2(const uint8_t *p, size_t n) {
+    const __m256i lut  = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low  = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t  i     = 0;
+
+    while (n - i >= 32) {
+        size_t  end = n - i >= 32 * 31 ? i + 32 * 31 : i + ((n - i) & ~(size_t)31);
+        __m256i acc = zero;
+        for (; i < end; i += 32) {
+            __m256i v  = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+            __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+            acc = _mm256_add_epi8(acc, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + popcount_popcnt(p + i, n - i);
+}
+#endif
+
+#ifdef HAVE_AVX512_POPCNT_DISPATCH
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t popcount_avx512(const uint8_t *p, size_t n) {
+    __m512i total = _mm512_setzero_si512();
+    size_t  i     = 0;
+    for (; n - i >= 64; i += 64)
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(p + i)));
+    return (size_t)_mm512_reduce_add_epi64(total) + popcount_popcnt(p + i, n - i);
+}
+#endif
+
+/* Selected once in Init_fast_bloom_filter() */
+static size_t (*popcount_bytes)(const uint8_t *, size_t) = popcount_scalar;
+static const char *popcount_kernel = "scalar";
+
+static void popcount_select_kernel(void) {
+#ifdef HAVE_AVX2_DISPATCH
+    const char *force = getenv("FAST_BLOOM_FILTER_SIMD");
+    if (force && strcmp(force, "scalar") == 0) return;
+
+    __builtin_cpu_init();
+#ifdef HAVE_AVX512_POPCNT_DISPATCH
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        popcount_bytes  = popcount_avx512;
+        popcount_kernel = "avx512";
+        return;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2")) {
+        popcount_bytes  = popcount_avx2;
+        popcount_kernel = "avx2";
+    } else if (__builtin_cpu_supports("popcnt")) {
+        popcount_bytes  = popcount_popcnt;
+        popcount_kernel = "popcnt";
+    }
+#endif
+}
+
+static inline uint32_t *layer_sbbf_block(const BloomLayer *layer, const BloomHash *h) {
+    return (uint32_t *)(layer->bits + layer_block_slot(layer, h) * SBBF_BLOCK_BYTES);
+}
+
+/* Sets the key's bits and returns how many flipped 0 -> 1; zero means
+ * the key was already a (possible) member of this layer.              */
+static int layer_set(BloomLayer *layer, const BloomHash *h) {
+    int (*set)(uint8_t *, size_t) = layer->atomic ? set_bit_atomic : set_bit;
+    int fresh = 0;  /* bits flipped 0 -> 1 */
+
+    switch (layer->layout) {
+    case LAYOUT_SPLIT_BLOCK: {
+        uint32_t *block = layer_sbbf_block(layer, h);
+
+        fresh = (layer->atomic ? sbbf_add_atomic : sbbf_add)(block, layer_block_key(layer, h));
+        if (layer->dirty)  /* blocks never straddle a page */
+            set(layer->dirty, ((uint8_t *)block - layer->bits) >> DIRTY_PAGE_SHIFT);
+        break;
+    }
+
+    case LAYOUT_BLOCKED: {
+        uint8_t *block = layer_block(layer, h);
+        uint32_t key   = layer_block_key(layer, h);
+
+        for (int i = 0; i < layer->num_hashes; i++)
+            fresh += set(block, block_bit(key, i));
+        if (layer->dirty)
+            set(layer->dirty, (size_t)(block - layer->bits) >> DIRTY_PAGE_SHIFT);
+        break;
+    }
+
+    case LAYOUT_COUNTING: {
+        unsigned (*inc)(uint8_t *, size_t) = layer->atomic ? counter_inc_atomic : counter_inc;
+
+        for (int i = 0; i < layer->num_hashes; i++) {
+            size_t   pos = layer_probe(layer, h, i);
+            unsigned old = inc(layer->bits, pos);
+
+            fresh += old == 0;
+            if (old == COUNTER_MAX - 1) {
+                if (layer->atomic) __atomic_fetch_add(&layer->saturated, 1, __ATOMIC_RELAXED);
+                else               layer->saturated++;
+            }
+            if (layer->dirty)
+                set(layer->dirty, pos >> (DIRTY_PAGE_SHIFT + 1));
+        }
+        break;
+    }
+
+    default:
+        for (int i = 0; i < layer->num_hashes; i++) {
+            size_t pos = layer_probe(layer, h, i);
+            fresh += set(layer->bits, pos);
+            if (layer->dirty)
+                set(layer->dirty, pos >> (DIRTY_PAGE_SHIFT + 3));
+        }
+        break;
+    }
+    return fresh;
+}
+
+static void layer_count(BloomLayer *layer, int fresh) {
+    if (layer->atomic) {
+        __atomic_fetch_add(&layer->count, 1, __ATOMIC_RELAXED);
+        if (fresh) __atomic_fetch_add(&layer->bits_set, (size_t)fresh, __ATOMIC_RELAXED);
+    } else {
+        layer->count++;
+        layer->bits_set += (size_t)fresh;
+    }
+}
+
+static void layer_add(BloomLayer *layer, const BloomHash *h) {
+    layer_count(layer, layer_set(layer, h));
+}
+
+/* Takes a member out of a counting layer. Callers hold the exclusive
+ * lock, so only the counters themselves can race (with the writers of
+ * a shared filter in other processes).                                */
+static void layer_remove(BloomLayer *layer, const BloomHash *h) {
+    unsigned (*dec)(uint8_t *, size_t) = layer->atomic ? counter_dec_atomic : counter_dec;
+    size_t cleared = 0;  /* counters dropped 1 -> 0 */
+
+    for (int i = 0; i < layer->num_hashes; i++) {
+        size_t pos = layer_probe(layer, h, i);
+
+        cleared += dec(layer->bits, pos) == 1;
+        if (layer->dirty)
+            set_bit(layer->dirty, pos >> (DIRTY_PAGE_SHIFT + 1));
+    }
+    if (layer->count) layer->count--;
+    layer->bits_set -= cleared < layer->bits_set ? cleared : layer->bits_set;
+}
+
+static int layer_include(const BloomLayer *layer, const BloomHash *h) {
+    switch (layer->layout) {
+    case LAYOUT_SPLIT_BLOCK:
+        return sbbf_check(layer_sbbf_block(layer, h), layer_block_key(layer, h));
+
+    case LAYOUT_BLOCKED: {
+        const uint8_t *block = layer_block(layer, h);
+        uint32_t key         = layer_block_key(layer, h);
+
+        for (int i = 0; i < layer->num_hashes; i++) {
+            if (!get_bit(block, block_bit(key, i)))
+                return 0;
+        }
+        return 1;
+    }
+
+    case LAYOUT_COUNTING:
+        for (int i = 0; i < layer->num_hashes; i++) {
+            if (!counter_get(layer->bits, layer_probe(layer, h, i)))
+                return 0;
+        }
+        return 1;
+
+    default:
+        for (int i = 0; i < layer->num_hashes; i++) {
+            if (!get_bit(layer->bits, layer_probe(layer, h, i)))
+                return 0;
+        }
+        return 1;
+    }
+}
+
+/* Issue prefetches for the cache lines a probe of this key will touch:
+ * the block for blocked layouts, the first `probes` bits otherwise.  */
+static inline void layer_prefetch(const BloomLayer *layer, const BloomHash *h,
+                                  int probes, int rw) {
+    switch (layer->layout) {
+    case LAYOUT_SPLIT_BLOCK:
+        BLOOM_PREFETCH(layer_sbbf_block(layer, h), rw);
+        break;
+
+    case LAYOUT_BLOCKED:
+        BLOOM_PREFETCH(layer_block(layer, h), rw);
+        break;
+
+    default:
+        if (probes > layer->num_hashes) probes = layer->num_hashes;
+        for (int i = 0; i < probes; i++) {
+            size_t pos = layer_probe(layer, h, i);
+            BLOOM_PREFETCH(layer->bits + pos / (layer->layout == LAYOUT_COUNTING ? 2 : 8), rw);
+        }
+        break;
+    }
+}
+
+/* Set bits in len bytes of the layer's array; non-zero counters for a
+ * counting layer.                                                     */
+static size_t layer_count_set(const BloomLayer *layer, const uint8_t *p, size_t len) {
+    if (layer->layout == LAYOUT_COUNTING) return counters_count(p, len, 0);
+    return popcount_bytes(p, len);
+}
+
+static size_t layer_count_saturated(const BloomLayer *layer, const uint8_t *p, size_t len) {
+    return layer->layout == LAYOUT_COUNTING ? counters_count(p, len, 1) : 0;
+}
+
+/* Bits set in the layer. Only this process writes arena and heap
+ * layers, so layer_add()'s counter is exact for them; mapped and
+ * shared layers may be written by other processes and are counted.   */
+static size_t layer_bits_set(const BloomLayer *layer) {
+    if (layer->backing == BACKING_ARENA || layer->backing == BACKING_HEAP)
+        return layer->bits_set;
+    return layer_count_set(layer, layer->bits, layer->size);
+}
+
+/* Saturated counters, kept and counted like layer_bits_set() */
+static size_t layer_saturated(const BloomLayer *layer) {
+    if (layer->backing == BACKING_ARENA || layer->backing == BACKING_HEAP)
+        return layer->saturated;
+    return layer_count_saturated(layer, layer->bits, layer->size);
+}
+
+/* After the bits were written other than through layer_add() */
+static void layer_recount(BloomLayer *layer) {
+    layer->bits_set  = layer_count_set(layer, layer->bits, layer->size);
+    layer->saturated = layer_count_saturated(layer, layer->bits, layer->size);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Scalable filter helpers                                           */
+/* ------------------------------------------------------------------ */
+
+static int layer_create_mapped(ScalableBloom *sb, BloomLayer *layer, size_t capacity,
+                               double error_rate);
+
+/* Error rate for the i-th layer (0-indexed):
+ *   layer_fpr(i) = error_rate * (1 - r) * r^i
+ * Sum converges to error_rate.                                       */
+static double layer_error_rate(double total_fpr, double r, size_t index) {
+    return total_fpr * (1.0 - r) * pow(r, (double)index);
+}
+
+/* Appends a copy of the header to the chain. Returns the new entry,
+ * or NULL with the layer left to the caller.                         */
+static BloomLayer *scalable_push_layer(ScalableBloom *sb, const BloomLayer *layer) {
+    if (sb->num_layers >= sb->layers_cap) {
+        size_t slots = sb->layers_cap == 0 ? 4 : sb->layers_cap * 2;
+        BloomLayer *tmp = (BloomLayer *)realloc(sb->layers, slots * sizeof(BloomLayer));
+        if (!tmp) return NULL;
+        sb->layers     = tmp;
+        sb->layers_cap = slots;
+    }
+
+    BloomLayer *l = &sb->layers[sb->num_layers++];
+    *l = *layer;
+    l->atomic    = sb->concurrent;
+    l->full_bits = sb->rollover == ROLLOVER_FILL ? layer_fill_limit(l) : 0;
+    if (l->hash64) sb->hash64 = 1;
+    return l;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Capacity of the next layer under the filter's GROWTH_* policy */
+static size_t scalable_next_capacity(const ScalableBloom *sb) {
+    if (sb->num_layers == 0) return sb->initial_capacity;
+
+    const BloomLayer *prev = &sb->layers[sb->num_layers - 1];
+    double cap = (double)prev->capacity * growth_factor(sb->num_layers);
+    if (sb->growth != GROWTH_ADAPTIVE) return (size_t)cap;
+
+    double want;
+    if (sb->expected_total > sb->total_count) {
+        want = (double)(sb->expected_total - sb->total_count);
+    } else {
+        double elapsed = monotonic_seconds() - sb->layer_started;
+        double most    = (double)prev->capacity * ADAPTIVE_MAX_GROWTH;
+        want = elapsed > 0 ? (double)prev->count / elapsed * sb->growth_horizon : most;
+        if (want > most) want = most;
+    }
+    return (size_t)(want > cap ? want : cap);
+}
+
+/* A read-write mapped filter keeps each layer in the file, listed in
+ * the file's layer table; once its spare slots are used up the filter
+ * cannot grow.                                                      */
+static inline int mapped_table_full(const ScalableBloom *sb) {
+    return sb->map_fd >= 0 && sb->num_layers >= sb->map_slots;
+}
+
+/* Appends an empty layer holding new_cap elements at the next layer's
+ * share of the error rate.                                          */
+static BloomLayer *scalable_add_layer_sized(ScalableBloom *sb, size_t new_cap) {
+    double fpr = layer_error_rate(sb->error_rate, sb->tightening, sb->num_layers);
+    if (fpr < 1e-15) fpr = 1e-15;  /* floor to avoid log(0) */
+
+    /* A read-write mapped filter grows only into its file */
+    if (mapped_table_full(sb)) return NULL;
+
+    BloomLayer layer;
+    int rc = sb->map_fd >= 0 ? layer_create_mapped(sb, &layer, new_cap, fpr)
+                             : layer_create(sb, &layer, new_cap, fpr);
+    if (rc != 0) return NULL;
+
+    BloomLayer *l = NULL;
+    if (!sb->track_changes || layer_track_changes(&layer) == 0)
+        l = scalable_push_layer(sb, &layer);
+    if (!l) layer_release(&layer);
+    else    sb->layer_started = monotonic_seconds();
+    return l;
+}
+
+static BloomLayer *scalable_add_layer(ScalableBloom *sb) {
+    return scalable_add_layer_sized(sb, scalable_next_capacity(sb));
+}
+
+static int layer_same_geometry(const BloomLayer *a, const BloomLayer *b) {
+    return a->size == b->size && a->slots == b->slots && a->num_hashes == b->num_hashes &&
+           a->layout == b->layout && a->sizing == b->sizing && a->hash64 == b->hash64;
+}
+
+/* Counting layers fold by adding counters, saturating at COUNTER_MAX */
+static void counters_merge(uint8_t *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned lo = (dst[i] & COUNTER_MAX) + (src[i] & COUNTER_MAX);
+        unsigned hi = (dst[i] >> COUNTER_BITS) + (src[i] >> COUNTER_BITS);
+        if (lo > COUNTER_MAX) lo = COUNTER_MAX;
+        if (hi > COUNTER_MAX) hi = COUNTER_MAX;
+        dst[i] = (uint8_t)(lo | hi << COUNTER_BITS);
+    }
+}
+
+/* ORs together layers of identical geometry — merge! of filters built
+ * with the same options leaves them side by side — as long as their
+ * counts still fit one layer's capacity, so the error rate holds.
+ * Layers of a single filter all differ in size and are left alone.  */
+static void scalable_fold_layers(ScalableBloom *sb) {
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        BloomLayer *a = &sb->layers[i];
+
+        for (size_t j = i + 1; j < sb->num_layers; ) {
+            BloomLayer *b = &sb->layers[j];
+            if (!layer_same_geometry(a, b) || a->count >= a->capacity ||
+                b->count > a->capacity - a->count) {
+                j++;
+                continue;
+            }
+
+            if (a->layout == LAYOUT_COUNTING) {
+                counters_merge(a->bits, b->bits, a->size);
+            } else {
+                /* Both arrays are padded to whole 64-bit words */
+                uint64_t       *dst = (uint64_t *)a->bits;
+                const uint64_t *src = (const uint64_t *)b->bits;
+                for (size_t w = 0; w < (a->size + 7) / 8; w++) dst[w] |= src[w];
+            }
+            a->count += b->count;
+            layer_recount(a);
+
+            /* Arena bits are not reused; hand their pages back at least */
+            if (b->backing == BACKING_ARENA) {
+                size_t    page = (size_t)sysconf(_SC_PAGESIZE);
+                uintptr_t lo   = ((uintptr_t)b->bits + page - 1) & ~(uintptr_t)(page - 1);
+                uintptr_t hi   = ((uintptr_t)b->bits + b->size) & ~(uintptr_t)(page - 1);
+                if (hi > lo) madvise((void *)lo, hi - lo, MADV_DONTNEED);
+            }
+            layer_release(b);
+            memmove(b, b + 1, (sb->num_layers - j - 1) * sizeof(BloomLayer));
+            sb->num_layers--;
+        }
+    }
+}
+
+/* Checks layers [0, top) from newest to oldest — most elements are
+ * in recent layers.                                                  */
+static int scalable_include_below(const ScalableBloom *sb, const BloomHash *h,
+                                  size_t top) {
+    for (size_t i = top; i > 0; i--) {
+        if (layer_include(&sb->layers[i - 1], h))
+            return 1;
+    }
+    return 0;
+}
+
+static int scalable_include(const ScalableBloom *sb, const BloomHash *h) {
+    return scalable_include_below(sb, h, sb->num_layers);
+}
+
+/* The layer a counting filter keeps a key in: the oldest one holding
+ * it, else the active one. add and delete both go there, so a key
+ * re-added after rollover is counted (and deletable) where it already
+ * was. Adding to a layer that holds the key only raises counters that
+ * are set already, so it never changes which keys an older layer
+ * holds, and neither do adds to the active one.                      */
+static BloomLayer *counting_home(ScalableBloom *sb, const BloomHash *h) {
+    for (size_t i = 0; i + 1 < sb->num_layers; i++) {
+        if (layer_include(&sb->layers[i], h))
+            return &sb->layers[i];
+    }
+    return &sb->layers[sb->num_layers - 1];
+}
+
+/* Every page of every layer clean, checkpoint numbering from 1 */
+static int scalable_track_changes(ScalableBloom *sb) {
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        if (layer_track_changes(&sb->layers[i]) != 0) return -1;
+    }
+    sb->track_changes  = 1;
+    sb->checkpoint_seq = 0;
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Batch operations                                                  */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    const char *ptr;
+    size_t      len;
+} BloomKey;
+
+/* Batches run as a pipeline over windows of prefetch_window keys: hash
+ * every key of the window and prefetch the lines it will touch, then
+ * probe. The misses of different keys overlap instead of serializing. */
+static inline size_t batch_window(const ScalableBloom *sb) {
+    if (sb->prefetch_window < 1) return 1;
+    if (sb->prefetch_window > MAX_PREFETCH_WINDOW) return MAX_PREFETCH_WINDOW;
+    return sb->prefetch_window;
+}
+
+#define BATCH_OK          0
+#define BATCH_NOMEM       (-1)   /* a new layer could not be allocated */
+#define BATCH_NEED_LAYER  1      /* concurrent: roll over, then resume */
+#define BATCH_FULL        (-2)   /* shared: the last layer is full */
+#define BATCH_TABLE_FULL  (-3)   /* mapped: no table slot for a layer */
+
+#define SNAPSHOT_SHARED_FILL  80   /* header offset, see the format */
+
+/* Every process writes a shared layer but counts only the bits it
+ * flipped itself (fetch-or tells exactly one writer). Every 1/64 of
+ * the layer's capacity it adds its new flips to the fill in the shared
+ * header and reads back everyone's: a process notices within that many
+ * adds that others filled the layer. Flips not yet published when a
+ * writer forks are published by both processes, which only makes the
+ * layer count as full a little early.                                */
+static int shared_layer_is_full(ScalableBloom *sb, BloomLayer *layer) {
+    size_t count = __atomic_load_n(&layer->count, __ATOMIC_RELAXED);
+    if (count % (layer->capacity / 64 + 1) == 0) {
+        uint64_t *fill = (uint64_t *)(sb->map + SNAPSHOT_SHARED_FILL);
+        size_t    mine = __atomic_load_n(&layer->bits_set, __ATOMIC_RELAXED);
+        size_t    prev = __atomic_load_n(&sb->shared_published, __ATOMIC_RELAXED);
+
+        while (mine > prev &&
+               !__atomic_compare_exchange_n(&sb->shared_published, &prev, mine, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+        uint64_t total = mine > prev
+                       ? __atomic_add_fetch(fill, (uint64_t)(mine - prev), __ATOMIC_RELAXED)
+                       : __atomic_load_n(fill, __ATOMIC_RELAXED);
+        __atomic_store_n(&sb->shared_fill, (size_t)total, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&sb->shared_fill, __ATOMIC_RELAXED) >= layer->full_bits;
+}
+
+/* Inserts keys until done, or until the active layer is full on a
+ * concurrent filter (rollover needs the exclusive lock) or a shared one
+ * (which cannot grow: a layer added after share! would be private to
+ * this process). *done counts
+ * the keys inserted either way. With `seen`, seen[j] records whether
+ * key j was possibly present already and only absent keys are counted
+ * in: the older layers are probed, then the active layer is tested by
+ * setting its bits -- one hash and one sweep, as add? needs.          */
+static int scalable_add_batch(ScalableBloom *sb, const BloomKey *keys, size_t n,
+                              uint8_t *seen, size_t *done) {
+    BloomHash hs[MAX_PREFETCH_WINDOW];
+    size_t window = batch_window(sb);
+
+    *done = 0;
+    for (size_t base = 0; base < n; base += window) {
+        size_t w = n - base < window ? n - base : window;
+        BloomLayer *active = &sb->layers[sb->num_layers - 1];
+
+        /* A rollover inside this window may bring in a 64-bit layer */
+        int hash64 = sb->hash64 || layer_may_fill(active, w);
+
+        for (size_t j = 0; j < w; j++) {
+            bloom_hash(&hs[j], keys[base + j].ptr, keys[base + j].len, hash64);
+            if (w > 1) layer_prefetch(active, &hs[j], active->num_hashes, 1);
+        }
+
+        for (size_t j = 0; j < w; j++) {
+            active = &sb->layers[sb->num_layers - 1];
+            if (sb->shared) {
+                if (shared_layer_is_full(sb, active)) return BATCH_FULL;
+            } else if (layer_is_full(active)) {
+                if (sb->concurrent) return BATCH_NEED_LAYER;
+                if (mapped_table_full(sb)) return BATCH_TABLE_FULL;
+                active = scalable_add_layer(sb);
+                if (!active) return BATCH_NOMEM;
+            }
+            if (seen) {
+                /* Older layers are probe-only; the active one is probed
+                 * by setting its bits, so a member flips none of them.
+                 * Setting would bump a member's counters, so a counting
+                 * layer (which merge! may put on top of any filter) is
+                 * probed first too.                                    */
+                size_t probed = sb->num_layers - (active->layout != LAYOUT_COUNTING);
+                int    fresh  = !scalable_include_below(sb, &hs[j], probed)
+                              ? layer_set(active, &hs[j]) : 0;
+
+                seen[base + j] = !fresh;
+                if (!fresh) {  /* already a member; nothing to insert */
+                    (*done)++;
+                    continue;
+                }
+                layer_count(active, fresh);
+            } else if (sb->layout == LAYOUT_COUNTING) {
+                layer_add(counting_home(sb, &hs[j]), &hs[j]);
+            } else {
+                layer_add(active, &hs[j]);
+            }
+
+            if (sb->concurrent)
+                __atomic_fetch_add(&sb->total_count, 1, __ATOMIC_RELAXED);
+            else
+                sb->total_count++;
+            (*done)++;
+        }
+    }
+    return BATCH_OK;
+}
+
+/* Sets bit i of `out` (zeroed by the caller) for every possible member. */
+static void scalable_include_batch(ScalableBloom *sb, const BloomKey *keys,
+                                   size_t n, uint8_t *out) {
+    size_t hits = 0;
+
+    BloomHash hs[MAX_PREFETCH_WINDOW];
+    size_t window = batch_window(sb);
+
+    for (size_t base = 0; base < n; base += window) {
+        size_t w = n - base < window ? n - base : window;
+
+        for (size_t j = 0; j < w; j++) {
+            bloom_hash(&hs[j], keys[base + j].ptr, keys[base + j].len, sb->hash64);
+            if (w > 1) {
+                /* Every probe of the newest (largest, checked first)
+                 * layer; older layers usually reject within a few.  */
+                size_t newest = sb->num_layers - 1;
+                for (size_t l = 0; l < sb->num_layers; l++)
+                    layer_prefetch(&sb->layers[l], &hs[j],
+                                   l == newest ? MAX_HASHES : PREFETCH_PROBES, 0);
+            }
+        }
+
+        for (size_t j = 0; j < w; j++) {
+            if (scalable_include(sb, &hs[j])) {
+                set_bit(out, base + j);
+                hits++;
+            }
+        }
+    }
+
+    __atomic_fetch_add(&sb->lookups, (uint64_t)n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sb->positives, (uint64_t)hits, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Serialization                                                     */
+/* ------------------------------------------------------------------ */
+
+/* Snapshot format, all integers little-endian, doubles as IEEE-754 bits:
+ *
+ *   header (128 bytes)
+ *     0  magic "FBLF"           4  u32 version
+ *     8  f64 error_rate        16  f64 tightening
+ *    24  u64 initial_capacity  32  u64 total_count
+ *    40  u32 layout            44  u32 sizing
+ *    48  u32 flags             52  u32 prefetch_window
+ *    56  u32 num_layers        60  u32 table_slots
+ *    64  u64 expected_total    72  f64 growth_horizon
+ *    80  u64 shared fill       88  reserved, zero
+ *     shared fill: bits of the last layer set by all the writers of a
+ *     Filter#share! region; zero in dumps and files
+ *     flags: 0x1 concurrent, 0x2 rollover by fill, 0x4 adaptive growth
+ *   layer table (64 bytes per slot, table_slots >= num_layers)
+ *     0  u64 capacity           8  u64 count
+ *    16  u64 size (bytes)      24  u64 slots
+ *    32  u64 requested_bits    40  u64 offset of the bits
+ *    48  u32 num_hashes        52  u32 layout
+ *    56  u32 sizing            60  u32 encoding
+ *   layer data, each at a 64-byte aligned offset
+ *     RAW   — the bit array as is
+ *     DELTA — u64 length, then varint(number of set bits) and a varint
+ *             gap before each set bit: a young layer that is mostly
+ *             zeros shrinks to a couple of bytes per set bit
+ *
+ * Layout 3 (counting) stores two 4-bit counters per byte, so its size
+ * is slots / 2. Everything else (slot_mask, hash64) is derived from
+ * the geometry, so
+ * loading a raw layer is one bulk copy. The spare table slots let a
+ * file opened read-write with Filter.open_mmap append new layers in
+ * place, at page-aligned offsets past the end of the file.           */
+#define SNAPSHOT_MAGIC        "FBLF"
+#define SNAPSHOT_VERSION      2
+#define SNAPSHOT_HEADER_BYTES 128
+#define SNAPSHOT_LAYER_BYTES  64
+#define SNAPSHOT_CONCURRENT   0x1
+#define SNAPSHOT_FILL_ROLLOVER 0x2
+#define SNAPSHOT_ADAPTIVE     0x4
+#define SNAPSHOT_SPARE_SLOTS  8
+#define SNAPSHOT_RAW          0
+#define SNAPSHOT_DELTA        1
+#define DELTA_MAX_FILL        (1.0 / 8)   /* gaps cannot beat raw bits above */
+#define DELTA_HEADROOM        80          /* varints of one byte's set bits */
+
+static inline uint8_t *snapshot_entry(uint8_t *buf, size_t i) {
+    return buf + SNAPSHOT_HEADER_BYTES + i * SNAPSHOT_LAYER_BYTES;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void put_f64(uint8_t *p, double d) {
+    uint64_t v;
+    memcpy(&v, &d, sizeof v);
+    put_u64(p, v);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline double get_f64(const uint8_t *p) {
+    uint64_t v = get_u64(p);
+    double   d;
+    memcpy(&d, &v, sizeof d);
+    return d;
+}
+
+static inline size_t snapshot_align(size_t n) {
+    return (n + BLOCK_BYTES - 1) & ~(size_t)(BLOCK_BYTES - 1);
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Resumable DELTA encoder: `byte` is the next byte to scan, `next` the
+ * position just after the last set bit written, `set` the set bits
+ * written so far.                                                    */
+typedef struct {
+    size_t   byte;
+    uint64_t next;
+    uint64_t set;
+} DeltaCursor;
+
+/* Writes gaps of the set bits from the cursor on while at least one
+ * byte's worth of varints fits; done when c->byte reaches size.      */
+static size_t delta_encode(const uint8_t *bits, size_t size, DeltaCursor *c,
+                           uint8_t *out, size_t cap) {
+    uint8_t *p = out;
+
+    while (c->byte < size && (size_t)(out + cap - p) >= DELTA_HEADROOM) {
+        if (c->byte % 8 == 0 && size - c->byte >= 8) {
+            uint64_t w;
+            memcpy(&w, bits + c->byte, 8);
+            if (w == 0) { c->byte += 8; continue; }
+        }
+        for (int j = 0; j < 8; j++) {
+            if (!(bits[c->byte] & (1 << j))) continue;
+            uint64_t pos = (uint64_t)c->byte * 8 + j;
+            p = put_varint(p, pos - c->next);
+            c->next = pos + 1;
+            c->set++;
+        }
+        c->byte++;
+    }
+    return (size_t)(p - out);
+}
+
+/* Resumable DELTA decoder, fed whatever bytes are at hand */
+typedef struct {
+    uint8_t *bits;
+    uint64_t nbits;
+    uint64_t next;
+    uint64_t left;     /* set bits still to come */
+    uint64_t acc;
+    int      shift;
+    int      started;  /* the count has been read */
+} DeltaDecoder;
+
+static inline int delta_done(const DeltaDecoder *d) {
+    return d->started && d->left == 0 && d->shift == 0;
+}
+
+/* Returns -1 on a malformed stream: gaps past the end of the layer,
+ * overlong varints or bytes after the last set bit.                   */
+static int delta_decode(DeltaDecoder *d, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (delta_done(d) || d->shift > 63) return -1;
+
+        d->acc |= (uint64_t)(p[i] & 0x7F) << d->shift;
+        if (p[i] & 0x80) { d->shift += 7; continue; }
+
+        uint64_t v = d->acc;
+        d->acc   = 0;
+        d->shift = 0;
+
+        if (!d->started) {
+            if (v > d->nbits) return -1;
+            d->started = 1;
+            d->left    = v;
+            continue;
+        }
+        if (v >= d->nbits - d->next) return -1;
+        set_bit(d->bits, d->next + v);
+        d->next += v + 1;
+        d->left--;
+    }
+    return 0;
+}
+
+/* How each layer is written: DELTA when the layer is sparse enough for
+ * its gaps to come out smaller than the raw bit array, RAW otherwise.
+ * `encoded` counts the count varint too.                             */
+typedef struct {
+    int    encoding;
+    size_t bits_set;
+    size_t encoded;
+} LayerPlan;
+
+/* Planning and writing must see the same bits: callers hold the
+ * exclusive lock. Other processes still write the layers of a filter
+ * shared with writers: true, so those are always planned RAW.        */
+static void snapshot_plan(const ScalableBloom *sb, LayerPlan *plans) {
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        LayerPlan *plan = &plans[i];
+
+        if (sb->shared && sb->concurrent) {
+            plan->encoding = SNAPSHOT_RAW;
+            continue;
+        }
+        plan->bits_set = popcount_bytes(l->bits, l->size);  /* exact: written out */
+        plan->encoding = (double)plan->bits_set < DELTA_MAX_FILL * (double)l->size * 8
+                       ? SNAPSHOT_DELTA : SNAPSHOT_RAW;
+        if (plan->encoding == SNAPSHOT_RAW) continue;
+
+        uint8_t     scratch[4096];
+        DeltaCursor c = {0, 0, 0};
+        plan->encoded = (size_t)(put_varint(scratch, plan->bits_set) - scratch);
+        while (c.byte < l->size)
+            plan->encoded += delta_encode(l->bits, l->size, &c, scratch, sizeof scratch);
+        if (plan->encoded >= l->size) plan->encoding = SNAPSHOT_RAW;
+    }
+}
+
+/* Bytes layer i takes in a snapshot (plans == NULL: all raw) */
+static inline size_t snapshot_layer_bytes(const ScalableBloom *sb, const LayerPlan *plans,
+                                          size_t i) {
+    if (plans && plans[i].encoding == SNAPSHOT_DELTA) return 8 + plans[i].encoded;
+    return sb->layers[i].size;
+}
+
+/* Header plus layer table */
+static size_t snapshot_table_size(const ScalableBloom *sb) {
+    return SNAPSHOT_HEADER_BYTES + (sb->num_layers + SNAPSHOT_SPARE_SLOTS) * SNAPSHOT_LAYER_BYTES;
+}
+
+/* Bytes snapshot_write() needs for the filter */
+static size_t snapshot_size(const ScalableBloom *sb, const LayerPlan *plans) {
+    size_t off = snapshot_table_size(sb);
+    for (size_t i = 0; i < sb->num_layers; i++)
+        off = snapshot_align(off) + snapshot_layer_bytes(sb, plans, i);
+    return off;
+}
+
+/* Writes the header and layer table into buf, which holds
+ * snapshot_table_size(sb) zeroed bytes.                              */
+static void snapshot_write_table(const ScalableBloom *sb, const LayerPlan *plans,
+                                 uint8_t *buf) {
+    memcpy(buf, SNAPSHOT_MAGIC, 4);
+    put_u32(buf + 4,  SNAPSHOT_VERSION);
+    put_f64(buf + 8,  sb->error_rate);
+    put_f64(buf + 16, sb->tightening);
+    put_u64(buf + 24, sb->initial_capacity);
+    put_u64(buf + 32, sb->total_count);
+    put_u32(buf + 40, (uint32_t)sb->layout);
+    put_u32(buf + 44, (uint32_t)sb->sizing);
+    put_u32(buf + 48, (sb->concurrent ? SNAPSHOT_CONCURRENT : 0) |
+                      (sb->rollover == ROLLOVER_FILL ? SNAPSHOT_FILL_ROLLOVER : 0) |
+                      (sb->growth == GROWTH_ADAPTIVE ? SNAPSHOT_ADAPTIVE : 0));
+    put_u32(buf + 52, (uint32_t)sb->prefetch_window);
+    put_u32(buf + 56, (uint32_t)sb->num_layers);
+    put_u32(buf + 60, (uint32_t)(sb->num_layers + SNAPSHOT_SPARE_SLOTS));
+    put_u64(buf + 64, sb->expected_total);
+    put_f64(buf + 72, sb->growth_horizon);
+
+    size_t off = snapshot_table_size(sb);
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        uint8_t *e = snapshot_entry(buf, i);
+
+        off = snapshot_align(off);
+        put_u64(e,      l->capacity);
+        put_u64(e + 8,  l->count);
+        put_u64(e + 16, l->size);
+        put_u64(e + 24, l->slots);
+        put_u64(e + 32, l->requested_bits);
+        put_u64(e + 40, off);
+        put_u32(e + 48, (uint32_t)l->num_hashes);
+        put_u32(e + 52, (uint32_t)l->layout);
+        put_u32(e + 56, (uint32_t)l->sizing);
+        put_u32(e + 60, plans ? (uint32_t)plans[i].encoding : SNAPSHOT_RAW);
+
+        off += snapshot_layer_bytes(sb, plans, i);
+    }
+}
+
+/* Serializes into buf, which holds snapshot_size(sb, plans) zeroed
+ * bytes. Returns -1, having written no further than its plan allows,
+ * if a DELTA layer no longer matches that plan; the caller then writes
+ * the snapshot again without one (all RAW).                          */
+static int snapshot_write(const ScalableBloom *sb, const LayerPlan *plans, uint8_t *buf) {
+    snapshot_write_table(sb, plans, buf);
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        uint8_t *dst = buf + get_u64(snapshot_entry(buf, i) + 40);
+
+        if (!plans || plans[i].encoding == SNAPSHOT_RAW) {
+            memcpy(dst, l->bits, l->size);
+            continue;
+        }
+
+        /* The encoder needs DELTA_HEADROOM to make progress, which the
+         * tail of the layer's slot lacks: encode through a scratch
+         * buffer and copy only what still fits.                      */
+        uint8_t     scratch[4096];
+        DeltaCursor c   = {0, 0, 0};
+        uint8_t    *p   = put_varint(dst + 8, plans[i].bits_set);
+        uint8_t    *end = dst + 8 + plans[i].encoded;
+        put_u64(dst, plans[i].encoded);
+        while (c.byte < l->size) {
+            size_t n = delta_encode(l->bits, l->size, &c, scratch, sizeof scratch);
+            if (n > (size_t)(end - p)) return -1;
+            memcpy(p, scratch, n);
+            p += n;
+        }
+        if (p != end || c.set != plans[i].bits_set) return -1;
+    }
+    return 0;
+}
+
+/* Reads the header into sb's configuration. Returns the number of
+ * layers, or 0 with *err set if buf is not a valid snapshot.         */
+static size_t snapshot_read_header(ScalableBloom *sb, const uint8_t *buf, size_t len,
+                                   const char **err) {
+    if (len < SNAPSHOT_HEADER_BYTES || memcmp(buf, SNAPSHOT_MAGIC, 4) != 0) {
+        *err = "not a FastBloomFilter snapshot";
+        return 0;
+    }
+    if (get_u32(buf + 4) != SNAPSHOT_VERSION) {
+        *err = "unsupported snapshot version";
+        return 0;
+    }
+
+    sb->error_rate       = get_f64(buf + 8);
+    sb->tightening       = get_f64(buf + 16);
+    sb->initial_capacity = get_u64(buf + 24);
+    sb->total_count      = get_u64(buf + 32);
+    sb->layout           = (int)get_u32(buf + 40);
+    sb->sizing           = (int)get_u32(buf + 44);
+    sb->concurrent       = (get_u32(buf + 48) & SNAPSHOT_CONCURRENT) != 0;
+    sb->rollover         = (get_u32(buf + 48) & SNAPSHOT_FILL_ROLLOVER) ? ROLLOVER_FILL
+                                                                        : ROLLOVER_COUNT;
+    sb->prefetch_window  = get_u32(buf + 52);
+    sb->growth           = (get_u32(buf + 48) & SNAPSHOT_ADAPTIVE) ? GROWTH_ADAPTIVE
+                                                                   : GROWTH_FIXED;
+    sb->expected_total   = get_u64(buf + 64);
+    sb->growth_horizon   = get_f64(buf + 72);
+    sb->layer_started    = monotonic_seconds();
+
+    size_t n     = get_u32(buf + 56);
+    size_t slots = get_u32(buf + 60);
+    if (!(sb->error_rate > 0 && sb->error_rate < 1) ||
+        !(sb->tightening > 0 && sb->tightening < 1) ||
+        sb->initial_capacity == 0 ||
+        (sb->expected_total > 0 && sb->growth != GROWTH_ADAPTIVE) ||
+        !(sb->growth_horizon > 0 && sb->growth_horizon < INFINITY) ||
+        sb->layout > LAYOUT_COUNTING || sb->sizing > SIZING_POW2 ||
+        sb->prefetch_window < 1 || sb->prefetch_window > MAX_PREFETCH_WINDOW ||
+        n == 0 || slots < n || slots > (len - SNAPSHOT_HEADER_BYTES) / SNAPSHOT_LAYER_BYTES) {
+        *err = "corrupt snapshot header";
+        return 0;
+    }
+    sb->map_slots = slots;
+    return n;
+}
+
+/* Reads the geometry and encoding of layer i and returns the offset
+ * of its data, or 0 with *err set if the entry is inconsistent.      */
+static size_t snapshot_read_layer(BloomLayer *layer, int *encoding, const uint8_t *buf,
+                                  size_t len, size_t i, const char **err) {
+    const uint8_t *e = snapshot_entry((uint8_t *)buf, i);
+    uint64_t off = get_u64(e + 40);
+
+    *encoding = (int)get_u32(e + 60);
+
+    memset(layer, 0, sizeof *layer);
+    layer->capacity       = get_u64(e);
+    layer->count          = get_u64(e + 8);
+    layer->size           = get_u64(e + 16);
+    layer->slots          = get_u64(e + 24);
+    layer->requested_bits = get_u64(e + 32);
+    layer->num_hashes     = (int)get_u32(e + 48);
+    layer->layout         = (int)get_u32(e + 52);
+    layer->sizing         = (int)get_u32(e + 56);
+
+    int valid = layer->layout <= LAYOUT_COUNTING && layer->sizing <= SIZING_POW2 &&
+                layer->capacity > 0 && layer->slots > 0 &&
+                layer->num_hashes >= MIN_HASHES && layer->num_hashes <= MAX_HASHES &&
+                layer->slots <= SIZE_MAX / layer_slot_bits(layer->layout) &&
+                layer->slots * layer_slot_bits(layer->layout) % 8 == 0 &&
+                layer->size == layer_array_bytes(layer->layout, layer->slots) &&
+                off % BLOCK_BYTES == 0 && off <= len &&
+                (*encoding == SNAPSHOT_RAW   ? layer->size <= len - off :
+                 *encoding == SNAPSHOT_DELTA ? len - off >= 8 : 0);
+    if (valid && layer->layout == LAYOUT_SPLIT_BLOCK)
+        valid = layer->num_hashes == SBBF_LANES;
+    if (valid && layer->sizing == SIZING_POW2)
+        valid = (layer->slots & (layer->slots - 1)) == 0;
+    if (!valid) {
+        *err = "corrupt snapshot layer";
+        return 0;
+    }
+
+    layer->slot_mask = layer->sizing == SIZING_POW2 ? layer->slots - 1 : 0;
+    layer->hash64    = layer->slots > (size_t)UINT32_MAX;
+    return (size_t)off;
+}
+
+/* Rebuilds every layer of an empty filter from a snapshot. Heap
+ * layers get a copy of their bits; mapped or shared ones point into
+ * buf. On failure the layers read so far stay attached for
+ * bloom_free_scalable().                                             */
+static int snapshot_load(ScalableBloom *sb, const uint8_t *buf, size_t len, int backing,
+                         const char **err) {
+    size_t n = snapshot_read_header(sb, buf, len, err);
+    if (n == 0) return -1;
+
+    sb->layers = (BloomLayer *)calloc(n, sizeof(BloomLayer));
+    if (!sb->layers) { *err = "failed to allocate layers"; return -1; }
+    sb->layers_cap = n;
+
+    for (size_t i = 0; i < n; i++) {
+        BloomLayer geometry;
+        int    encoding;
+        size_t off = snapshot_read_layer(&geometry, &encoding, buf, len, i, err);
+        if (off == 0) return -1;
+        if (encoding != SNAPSHOT_RAW && backing != BACKING_HEAP) {
+            *err = "compressed snapshots cannot be mapped";
+            return -1;
+        }
+
+        if (backing != BACKING_HEAP) {
+            geometry.bits    = (uint8_t *)buf + off;
+            geometry.backing = backing;
+        } else {
+            geometry.bits    = arena_alloc(sb, geometry.size);
+            geometry.backing = BACKING_ARENA;
+            if (!geometry.bits) { *err = "failed to allocate layer"; return -1; }
+        }
+
+        /* layers[] was sized for the table: this cannot fail */
+        BloomLayer *layer = scalable_push_layer(sb, &geometry);
+
+        if (encoding == SNAPSHOT_RAW) {
+            if (backing == BACKING_HEAP) {
+                memcpy(layer->bits, buf + off, layer->size);
+                layer_recount(layer);
+            }
+            continue;
+        }
+
+        uint64_t     enc_len = get_u64(buf + off);
+        DeltaDecoder d       = {layer->bits, (uint64_t)layer->size * 8, 0, 0, 0, 0, 0};
+        if (enc_len > len - off - 8 ||
+            delta_decode(&d, buf + off + 8, (size_t)enc_len) != 0 || !delta_done(&d)) {
+            *err = "corrupt snapshot layer";
+            return -1;
+        }
+        layer_recount(layer);
+    }
+
+    /* Fill rollover reads the active layer's counter, which mapped
+     * layers do not get from the copy above                           */
+    if (sb->rollover == ROLLOVER_FILL && backing != BACKING_HEAP)
+        layer_recount(&sb->layers[n - 1]);
+    return 0;
+}
+
+/* Streams (Filter#dump_to / Filter.load_from) carry the same header
+ * and table in frames, so memory stays bounded by one chunk:
+ *
+ *   "FBLS"  u32 version
+ *   frame   u64 snapshot size, header + layer table
+ *   frames  each layer's bits in order, at most chunk_size per frame
+ *   frame   empty, marks the end
+ *
+ * A frame is u32 payload length, u32 CRC-32 of the payload (the zlib
+ * polynomial, so Zlib.crc32 agrees), then the payload.              */
+#define STREAM_MAGIC          "FBLS"
+#define STREAM_VERSION        1
+#define STREAM_FRAME_BYTES    8
+#define STREAM_DEFAULT_CHUNK  (1 << 20)
+#define STREAM_MAX_TABLE      (1 << 20)
+
+/* Checkpoints (Filter#checkpoint / Filter#replay) reuse the framing:
+ * "FBLD", the version and the header/table frame (counters and every
+ * layer's geometry), a frame with the u64 sequence number, then a
+ * frame per run of dirty pages holding u32 layer, u32 reserved, u64
+ * byte offset and the bytes, then an empty frame. Sequence numbers
+ * restart at 1 with track_changes! and must be replayed in order.    */
+#define CHECKPOINT_MAGIC      "FBLD"
+
+static uint32_t crc32_tables[8][256];
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = (c >> 1) ^ (0xEDB88320U & (0U - (c & 1)));
+        crc32_tables[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc32_tables[t][i] = (crc32_tables[t - 1][i] >> 8) ^
+                                 crc32_tables[0][crc32_tables[t - 1][i] & 0xFF];
+}
+
+/* Slicing-by-8: eight table lookups per 8 input bytes */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ get_u32(p);
+        uint32_t hi = get_u32(p + 4);
+        crc = crc32_tables[7][lo & 0xFF]         ^ crc32_tables[6][(lo >> 8) & 0xFF] ^
+              crc32_tables[5][(lo >> 16) & 0xFF] ^ crc32_tables[4][lo >> 24] ^
+              crc32_tables[3][hi & 0xFF]         ^ crc32_tables[2][(hi >> 8) & 0xFF] ^
+              crc32_tables[1][(hi >> 16) & 0xFF] ^ crc32_tables[0][hi >> 24];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32_tables[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+/* Appends a zeroed layer to a read-write mapped file: extend the file
+ * to a page boundary plus the layer, map just that range and record
+ * it in the next table slot. The header's layer count is bumped at
+ * once; counters reach the file on the next snapshot_sync().         */
+static int layer_create_mapped(ScalableBloom *sb, BloomLayer *layer, size_t capacity,
+                               double error_rate) {
+    memset(layer, 0, sizeof(*layer));
+    layer_geometry(layer, capacity, error_rate, sb->layout, sb->sizing);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t off  = (sb->file_len + page - 1) / page * page;
+    size_t len  = (layer->size + page - 1) / page * page;
+
+    if (ftruncate(sb->map_fd, (off_t)(off + layer->size)) != 0) return -1;
+
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, sb->map_fd, (off_t)off);
+    if (p == MAP_FAILED) {
+        if (ftruncate(sb->map_fd, (off_t)sb->file_len) != 0) { /* best effort */ }
+        return -1;
+    }
+
+    layer->bits    = (uint8_t *)p;
+    layer->backing = BACKING_MMAP;
+    layer->map     = p;
+    layer->map_len = len;
+    sb->file_len   = off + layer->size;
+
+    uint8_t *e = snapshot_entry(sb->map, sb->num_layers);
+    memset(e, 0, SNAPSHOT_LAYER_BYTES);
+    put_u64(e,      layer->capacity);
+    put_u64(e + 16, layer->size);
+    put_u64(e + 24, layer->slots);
+    put_u64(e + 32, layer->requested_bits);
+    put_u64(e + 40, off);
+    put_u32(e + 48, (uint32_t)layer->num_hashes);
+    put_u32(e + 52, (uint32_t)layer->layout);
+    put_u32(e + 56, (uint32_t)layer->sizing);
+    put_u32(sb->map + 56, (uint32_t)sb->num_layers + 1);
+    return 0;
+}
+
+/* Writes the counters into the mapped header and table. Returns -1,
+ * with the file untouched, if a layer does not live in the file.    */
+static int snapshot_store_counts(ScalableBloom *sb) {
+    for (size_t i = 0; i < sb->num_layers; i++)
+        if (sb->layers[i].backing != BACKING_MMAP) return -1;
+
+    put_u64(sb->map + 32, sb->total_count);
+    for (size_t i = 0; i < sb->num_layers; i++)
+        put_u64(snapshot_entry(sb->map, i) + 8, sb->layers[i].count);
+    return 0;
+}
+
+/* Flushes the mappings to the file. Returns -1 (errno set) on error. */
+static int snapshot_sync(ScalableBloom *sb) {
+    if (msync(sb->map, sb->map_len, MS_SYNC) != 0) return -1;
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        BloomLayer *l = &sb->layers[i];
+        if (l->map && msync(l->map, l->map_len, MS_SYNC) != 0) return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Ruby GC integration                                               */
+/* ------------------------------------------------------------------ */
+
+static void bloom_free_scalable(void *ptr) {
+    ScalableBloom *sb = (ScalableBloom *)ptr;
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        layer_release(&sb->layers[i]);
+    }
+    free(sb->layers);
+    arena_free(sb);
+    if (sb->map) munmap(sb->map, sb->map_len);
+    if (sb->map_fd >= 0) close(sb->map_fd);
+    pthread_rwlock_destroy(&sb->lock);
+    free(sb);
+}
+
+static size_t bloom_memsize_scalable(const void *ptr) {
+    const ScalableBloom *sb = (const ScalableBloom *)ptr;
+    size_t total = sizeof(ScalableBloom);
+    total += sb->layers_cap * sizeof(BloomLayer);
+    for (const ArenaSlab *slab = sb->arena; slab; slab = slab->next)
+        total += slab->used;
+    /* Mapped bits live in the page cache, not the Ruby heap */
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        if (l->backing == BACKING_HEAP) total += l->size;
+        if (l->dirty) total += layer_dirty_bytes(l);
+    }
+    return total;
+}
+
+static const rb_data_type_t scalable_bloom_type = {
+    "ScalableBloomFilter",
+    {NULL, bloom_free_scalable, bloom_memsize_scalable},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* ------------------------------------------------------------------ */
+/*  Locking                                                           */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    ScalableBloom *sb;
+    int exclusive;
+    int locked;
+    int err;     /* pthread error, 0 if locked or never tried */
+} LockWait;
+
+static void *bloom_lock_nogvl(void *ptr) {
+    LockWait *w = (LockWait *)ptr;
+    w->err    = w->exclusive ? pthread_rwlock_wrlock(&w->sb->lock)
+                             : pthread_rwlock_rdlock(&w->sb->lock);
+    w->locked = w->err == 0;
+    return NULL;
+}
+
+/* dump_to, checkpoint and replay call io.write or io.read with the
+ * lock held. An IO that calls back into the same filter would wait for
+ * itself (or race the stream on a second read lock), so each thread
+ * lists the filters it streams and bloom_lock() refuses them. Not a
+ * plain stack: fibers of one thread may finish streams in any order. */
+typedef struct StreamHold {
+    const ScalableBloom *sb;
+    struct StreamHold   *prev;
+} StreamHold;
+
+static __thread StreamHold *stream_holds;
+
+static void check_not_streaming(const ScalableBloom *sb) {
+    for (const StreamHold *h = stream_holds; h; h = h->prev) {
+        if (h->sb == sb)
+            rb_raise(rb_eThreadError,
+                     "filter is locked while this thread streams it to or from an IO");
+    }
+}
+
+/* Lock from a thread holding the GVL: a single trylock when there is
+ * no contention, otherwise wait with the GVL released so that other
+ * Ruby threads keep running while a batch finishes. Those threads may
+ * change any String, so callers must not hold pointers into Strings
+ * across the call. A pending interrupt is handled before waiting
+ * (RB_NOGVL_INTR_FAIL), never once the lock is held, where raising
+ * would leave it locked for good.                                     */
+static void bloom_lock(ScalableBloom *sb, int exclusive) {
+    check_not_streaming(sb);
+
+    int rc = exclusive ? pthread_rwlock_trywrlock(&sb->lock)
+                       : pthread_rwlock_tryrdlock(&sb->lock);
+    if (rc == 0) return;
+
+    LockWait w = {sb, exclusive, 0, 0};
+    while (!w.locked) {
+        rb_nogvl(bloom_lock_nogvl, &w, NULL, NULL, RB_NOGVL_INTR_FAIL);
+        if (w.err == EDEADLK)
+            rb_raise(rb_eThreadError, "filter is already locked by this thread");
+        if (w.err != 0)
+            rb_syserr_fail(w.err, "pthread_rwlock");
+        if (!w.locked) rb_thread_check_ints();
+    }
+}
+
+static void bloom_unlock(ScalableBloom *sb) {
+    pthread_rwlock_unlock(&sb->lock);
+}
+
+static void stream_lock(ScalableBloom *sb, int exclusive, StreamHold *hold) {
+    bloom_lock(sb, exclusive);
+    hold->sb     = sb;
+    hold->prev   = stream_holds;
+    stream_holds = hold;
+}
+
+static VALUE stream_unlock_value(VALUE ptr) {
+    StreamHold  *hold = (StreamHold *)ptr;
+    StreamHold **h    = &stream_holds;
+    while (*h && *h != hold) h = &(*h)->prev;
+    if (*h) *h = hold->prev;
+    bloom_unlock((ScalableBloom *)hold->sb);
+    return Qnil;
+}
+
+static void filter_lock(ScalableBloom *sb, int exclusive, int have_gvl) {
+    if (have_gvl)
+        bloom_lock(sb, exclusive);
+    else if (exclusive)
+        pthread_rwlock_wrlock(&sb->lock);
+    else
+        pthread_rwlock_rdlock(&sb->lock);
+}
+
+/* Insert under the filter lock. Concurrent filters insert with the lock
+ * shared and upgrade to exclusive only for rollover, re-checking that
+ * the layer is still full so that a single thread allocates it.       */
+static int scalable_add_locked(ScalableBloom *sb, const BloomKey *keys, size_t n,
+                               uint8_t *seen, int have_gvl) {
+    for (;;) {
+        size_t done;
+
+        filter_lock(sb, !sb->concurrent, have_gvl);
+        int rc = scalable_add_batch(sb, keys, n, seen, &done);
+        bloom_unlock(sb);
+
+        /* add? keys found already present were not inserted */
+        size_t added = done;
+        if (seen)
+            for (size_t j = 0; j < done; j++) added -= seen[j];
+        __atomic_fetch_add(&sb->adds, (uint64_t)added, __ATOMIC_RELAXED);
+
+        if (rc != BATCH_NEED_LAYER) return rc;
+        keys += done;
+        n    -= done;
+        if (seen) seen += done;
+
+        filter_lock(sb, 1, have_gvl);
+        if (layer_is_full(&sb->layers[sb->num_layers - 1]))
+            rc = mapped_table_full(sb) ? BATCH_TABLE_FULL
+               : scalable_add_layer(sb) ? BATCH_NEED_LAYER : BATCH_NOMEM;
+        bloom_unlock(sb);
+
+        if (rc != BATCH_NEED_LAYER) return rc;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Ruby methods                                                      */
+/* ------------------------------------------------------------------ */
+
+static int layout_from_sym(VALUE sym) {
+    if (sym == ID2SYM(rb_intern("standard"))) return LAYOUT_STANDARD;
+    if (sym == ID2SYM(rb_intern("blocked")))  return LAYOUT_BLOCKED;
+    if (sym == ID2SYM(rb_intern("split_block"))) return LAYOUT_SPLIT_BLOCK;
+    if (sym == ID2SYM(rb_intern("counting")))  return LAYOUT_COUNTING;
+    rb_raise(rb_eArgError, "layout must be :standard, :blocked, :split_block or :counting");
+    return LAYOUT_STANDARD;  /* not reached */
+}
+
+static int sizing_from_sym(VALUE sym) {
+    if (sym == ID2SYM(rb_intern("exact"))) return SIZING_EXACT;
+    if (sym == ID2SYM(rb_intern("pow2")))  return SIZING_POW2;
+    rb_raise(rb_eArgError, "sizing must be :exact or :pow2");
+    return SIZING_EXACT;  /* not reached */
+}
+
+static VALUE sizing_to_sym(int sizing) {
+    return ID2SYM(rb_intern(sizing == SIZING_POW2 ? "pow2" : "exact"));
+}
+
+static VALUE layout_to_sym(int layout) {
+    switch (layout) {
+    case LAYOUT_BLOCKED:     return ID2SYM(rb_intern("blocked"));
+    case LAYOUT_SPLIT_BLOCK: return ID2SYM(rb_intern("split_block"));
+    case LAYOUT_COUNTING:    return ID2SYM(rb_intern("counting"));
+    default:                 return ID2SYM(rb_intern("standard"));
+    }
+}
+
+static VALUE backing_to_sym(int backing) {
+    switch (backing) {
+    case BACKING_MMAP:   return ID2SYM(rb_intern("mmap"));
+    case BACKING_SHARED: return ID2SYM(rb_intern("shared"));
+    case BACKING_ARENA:  return ID2SYM(rb_intern("arena"));
+    default:             return ID2SYM(rb_intern("heap"));
+    }
+}
+
+static int huge_pages_from_opt(VALUE v) {
+    if (v == Qfalse) return HUGE_PAGES_NONE;
+    if (v == ID2SYM(rb_intern("transparent"))) return HUGE_PAGES_TRANSPARENT;
+    if (v == ID2SYM(rb_intern("hugetlb")))     return HUGE_PAGES_HUGETLB;
+    rb_raise(rb_eArgError, "huge_pages must be :transparent, :hugetlb or false");
+    return HUGE_PAGES_TRANSPARENT;  /* not reached */
+}
+
+static int growth_from_sym(VALUE sym) {
+    if (sym == ID2SYM(rb_intern("fixed")))    return GROWTH_FIXED;
+    if (sym == ID2SYM(rb_intern("adaptive"))) return GROWTH_ADAPTIVE;
+    rb_raise(rb_eArgError, "growth must be :fixed or :adaptive");
+    return GROWTH_FIXED;  /* not reached */
+}
+
+static int rollover_from_sym(VALUE sym) {
+    if (sym == ID2SYM(rb_intern("count"))) return ROLLOVER_COUNT;
+    if (sym == ID2SYM(rb_intern("fill")))  return ROLLOVER_FILL;
+    rb_raise(rb_eArgError, "rollover must be :count or :fill");
+    return ROLLOVER_COUNT;  /* not reached */
+}
+
+static VALUE pages_to_sym(int pages) {
+    switch (pages) {
+    case HUGE_PAGES_TRANSPARENT: return ID2SYM(rb_intern("transparent"));
+    case HUGE_PAGES_HUGETLB:     return ID2SYM(rb_intern("hugetlb"));
+    default:                     return ID2SYM(rb_intern("normal"));
+    }
+}
+
+static VALUE bloom_alloc(VALUE klass) {
+    ScalableBloom *sb = (ScalableBloom *)calloc(1, sizeof(ScalableBloom));
+    if (!sb) rb_raise(rb_eNoMemError, "failed to allocate ScalableBloom");
+    pthread_rwlock_init(&sb->lock, NULL);
+    sb->map_fd = -1;
+
+    return TypedData_Wrap_Struct(klass, &scalable_bloom_type, sb);
+}
+
+/*
+ * call-seq:
+ *   Filter.new                                  # defaults: error_rate 0.01, initial_capacity 1024
+ *   Filter.new(error_rate: 0.001)
+ *   Filter.new(error_rate: 0.01, initial_capacity: 10_000)
+ *   Filter.new(layout: :blocked)                # one cache line per key
+ *   Filter.new(layout: :split_block)            # SBBF, AVX2 when available
+ *   Filter.new(layout: :counting)               # 4-bit counters, supports #delete
+ *   Filter.new(sizing: :pow2)                   # mask instead of multiply-shift
+ *   Filter.new(prefetch_window: 32)             # keys in flight in batch ops
+ *   Filter.new(concurrent: true)                # parallel writers, atomic bits
+ *   Filter.new(track_changes: true)             # dirty pages for #checkpoint
+ *   Filter.new(huge_pages: :hugetlb)            # 2 MB pages for large layers
+ *   Filter.new(growth: :adaptive)               # size layers from the insert rate
+ *   Filter.new(expected_total: 50_000_000)      # ...or from a hint (implies :adaptive)
+ *   Filter.new(rollover: :fill)                 # duplicates do not fill layers
+ *
+ * No upfront capacity needed — the filter grows automatically.
+ *
+ * Ruby 2.7+ compatible: keyword arguments are parsed manually from
+ * a trailing Hash argument. The rb_scan_args ":" format requires
+ * Ruby 3.2+, so we handle it ourselves for broad compatibility.
  */
-static VALUE bloom_stats(VALUE self) {
+static VALUE bloom_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE opts = Qnil;
+
+    if (argc == 0) {
+        /* Filter.new — all defaults */
+    } else if (argc == 1 && RB_TYPE_P(argv[0], T_HASH)) {
+        /* Filter.new(error_rate: 0.01, ...) — keyword args as hash */
+        opts = argv[0];
+    } else {
+        rb_raise(rb_eArgError,
+                 "wrong number of arguments (given %d, expected 0 or keyword arguments)",
+                 argc);
+    }
+
+    double error_rate       = DEFAULT_ERROR_RATE;
+    size_t initial_capacity = DEFAULT_INITIAL_CAP;
+    double tightening       = DEFAULT_TIGHTENING;
+    int    layout           = LAYOUT_STANDARD;
+    int    sizing           = SIZING_EXACT;
+    long   prefetch_window  = DEFAULT_PREFETCH_WINDOW;
+    int    concurrent       = 0;
+    int    track_changes    = 0;
+    int    huge_pages       = HUGE_PAGES_TRANSPARENT;
+    int    growth           = -1;
+    long   expected_total   = 0;
+    double growth_horizon   = DEFAULT_GROWTH_HORIZON;
+    int    rollover         = ROLLOVER_COUNT;
+
+    if (!NIL_P(opts)) {
+        VALUE v;
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("error_rate")));
+        if (!NIL_P(v)) error_rate = NUM2DBL(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("initial_capacity")));
+        if (!NIL_P(v)) initial_capacity = (size_t)NUM2LONG(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("tightening")));
+        if (!NIL_P(v)) tightening = NUM2DBL(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("layout")));
+        if (!NIL_P(v)) layout = layout_from_sym(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("sizing")));
+        if (!NIL_P(v)) sizing = sizing_from_sym(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("prefetch_window")));
+        if (!NIL_P(v)) prefetch_window = NUM2LONG(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("concurrent")));
+        concurrent = RTEST(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("track_changes")));
+        track_changes = RTEST(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("huge_pages")));
+        if (!NIL_P(v)) huge_pages = huge_pages_from_opt(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("growth")));
+        if (!NIL_P(v)) growth = growth_from_sym(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("expected_total")));
+        if (!NIL_P(v)) expected_total = NUM2LONG(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("growth_horizon")));
+        if (!NIL_P(v)) growth_horizon = NUM2DBL(v);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("rollover")));
+        if (!NIL_P(v)) rollover = rollover_from_sym(v);
+    }
+
+    /* A hint is only read by the adaptive policy */
+    if (growth < 0) growth = expected_total > 0 ? GROWTH_ADAPTIVE : GROWTH_FIXED;
+
+    if (error_rate <= 0 || error_rate >= 1)
+        rb_raise(rb_eArgError, "error_rate must be between 0 and 1 (exclusive)");
+    if (initial_capacity == 0)
+        rb_raise(rb_eArgError, "initial_capacity must be positive");
+    if (tightening <= 0 || tightening >= 1)
+        rb_raise(rb_eArgError, "tightening must be between 0 and 1 (exclusive)");
+    if (prefetch_window < 1 || prefetch_window > MAX_PREFETCH_WINDOW)
+        rb_raise(rb_eArgError, "prefetch_window must be between 1 and %d", MAX_PREFETCH_WINDOW);
+    if (expected_total < 0)
+        rb_raise(rb_eArgError, "expected_total must not be negative");
+    if (expected_total > 0 && growth != GROWTH_ADAPTIVE)
+        rb_raise(rb_eArgError, "expected_total needs growth: :adaptive");
+    if (!(growth_horizon > 0))
+        rb_raise(rb_eArgError, "growth_horizon must be positive");
+
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    sb->error_rate       = error_rate;
+    sb->initial_capacity = initial_capacity;
+    sb->tightening       = tightening;
+    sb->layout           = layout;
+    sb->sizing           = sizing;
+    sb->prefetch_window  = (size_t)prefetch_window;
+    sb->concurrent       = concurrent;
+    sb->track_changes    = track_changes;
+    sb->huge_pages       = huge_pages;
+    sb->growth           = growth;
+    sb->expected_total   = (size_t)expected_total;
+    sb->growth_horizon   = growth_horizon;
+    sb->rollover         = rollover;
+    sb->total_count      = 0;
+
+    /* Create first layer */
+    if (!scalable_add_layer(sb))
+        rb_raise(rb_eNoMemError, "failed to allocate initial layer");
+
+    return self;
+}
+
+/* Read-only mappings are PROT_READ: writing would fault */
+static void bloom_check_writable(const ScalableBloom *sb) {
+    if (sb->read_only)
+        rb_raise(rb_eIOError, "filter is mapped read-only");
+}
+
+static void batch_raise(int rc) {
+    if (rc == BATCH_FULL)
+        rb_raise(rb_eRuntimeError, "shared filter is full; its geometry is fixed by share!");
+    if (rc == BATCH_TABLE_FULL)
+        rb_raise(rb_eIOError, "layer table is full; dump the filter to a new file");
+    rb_raise(rb_eNoMemError, "failed to allocate new layer");
+}
+
+/* add and add?: the key is hashed under the filter lock, and waiting
+ * for it may let other threads change or free the String's buffer, so
+ * the filter works on a copy (on the stack unless it is large).      */
+static int bloom_add_string(ScalableBloom *sb, VALUE str, uint8_t *seen) {
+    long  len = RSTRING_LEN(str);
+    VALUE tmp;
+    char *copy = ALLOCV_N(char, tmp, len);
+
+    memcpy(copy, RSTRING_PTR(str), (size_t)len);
+    BloomKey key = {copy, (size_t)len};
+    int rc = scalable_add_locked(sb, &key, 1, seen, 1);
+
+    ALLOCV_END(tmp);
+    return rc;
+}
+
+/*
+ * call-seq:
+ *   filter.add("element")
+ *   filter << "element"
+ */
+static VALUE bloom_add(VALUE self, VALUE str) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    Check_Type(str, T_STRING);
+    bloom_check_writable(sb);
+
+    /* Grows a new layer if the current one is full */
+    int rc = bloom_add_string(sb, str, NULL);
+    if (rc != BATCH_OK) batch_raise(rc);
+
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   filter.add?("element")  #=> true if possibly present, false if new
+ *
+ * Test-and-set in a single hash and probe sweep: inserts the key and
+ * reports whether it may have been there before. Unlike Set#add?, a
+ * true answer means "seen (probably)" and false means "definitely new",
+ * so a dedup loop reads `next if filter.add?(key)`. Keys already
+ * present are not inserted again, so repeats do not use up capacity.
+ */
+static VALUE bloom_add_p(VALUE self, VALUE str) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    Check_Type(str, T_STRING);
+    bloom_check_writable(sb);
+
+    uint8_t seen = 0;
+    int rc = bloom_add_string(sb, str, &seen);
+    if (rc != BATCH_OK) batch_raise(rc);
+
+    __atomic_fetch_add(&sb->lookups, 1, __ATOMIC_RELAXED);
+    if (seen) __atomic_fetch_add(&sb->positives, 1, __ATOMIC_RELAXED);
+    return seen ? Qtrue : Qfalse;
+}
+
+/*
+ * Batch plumbing shared by add_many and include_many.
+ *
+ * Keys are gathered a chunk at a time. Elements are first converted
+ * with #to_s into `strs` (which may run Ruby code), then their bytes
+ * are copied into `bytebuf` and `keybuf` points into the copy. Large
+ * batches run without the GVL, and small ones may give it up waiting
+ * for the filter lock: either way other threads may run (and mutate
+ * the original Strings) while the filter works on its private copy.
+ */
+typedef struct {
+    ScalableBloom  *sb;
+    const BloomKey *keys;
+    size_t          n;
+    uint8_t        *out;   /* include_many: one bit per key */
+    int             rc;    /* add_many: scalable_add_batch() result */
+} BatchCall;
+
+static long batch_collect(VALUE ary, long start, long chunk, VALUE strs,
+                          VALUE keybuf, VALUE bytebuf) {
+    rb_ary_clear(strs);
+    for (long i = start; i < RARRAY_LEN(ary) && i - start < chunk; i++) {
+        VALUE str = RARRAY_AREF(ary, i);
+        if (!RB_TYPE_P(str, T_STRING)) str = rb_obj_as_string(str);
+        rb_ary_push(strs, str);
+    }
+
+    long n = RARRAY_LEN(strs);
+    rb_str_resize(keybuf, n * (long)sizeof(BloomKey));
+    BloomKey *keys = (BloomKey *)RSTRING_PTR(keybuf);
+
+    long bytes = 0;
+    for (long i = 0; i < n; i++) bytes += RSTRING_LEN(RARRAY_AREF(strs, i));
+    rb_str_resize(bytebuf, bytes);
+
+    char *dst = RSTRING_PTR(bytebuf);
+    for (long i = 0; i < n; i++) {
+        VALUE str = RARRAY_AREF(strs, i);
+        memcpy(dst, RSTRING_PTR(str), RSTRING_LEN(str));
+        keys[i].ptr = dst;
+        keys[i].len = RSTRING_LEN(str);
+        dst += RSTRING_LEN(str);
+    }
+    return n;
+}
+
+static void *batch_add_nogvl(void *ptr) {
+    BatchCall *call = (BatchCall *)ptr;
+    call->rc = scalable_add_locked(call->sb, call->keys, call->n, NULL, 0);
+    return NULL;
+}
+
+static void *batch_include_nogvl(void *ptr) {
+    BatchCall *call = (BatchCall *)ptr;
+    pthread_rwlock_rdlock(&call->sb->lock);
+    scalable_include_batch(call->sb, call->keys, call->n, call->out);
+    pthread_rwlock_unlock(&call->sb->lock);
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   filter.add_many(["a", "b", "c"])   #=> filter
+ *
+ * Batch insert: one struct lookup per chunk of keys, hashing and
+ * probing pipelined with prefetches, layer rollover handled inline.
+ * Batches of NOGVL_MIN_KEYS keys or more release the GVL while they
+ * work. Non-String elements are converted with #to_s, like add_all.
+ */
+static VALUE bloom_add_many(VALUE self, VALUE ary) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    Check_Type(ary, T_ARRAY);
+    bloom_check_writable(sb);
+
+    check_not_streaming(sb);
+
+    int   nogvl   = RARRAY_LEN(ary) >= NOGVL_MIN_KEYS;
+    long  chunk   = nogvl ? NOGVL_CHUNK : BATCH_CHUNK;
+    VALUE strs    = rb_ary_new_capa(chunk);
+    VALUE keybuf  = rb_str_buf_new(chunk * (long)sizeof(BloomKey));
+    VALUE bytebuf = rb_str_buf_new(0);
+
+    for (long start = 0; start < RARRAY_LEN(ary); start += chunk) {
+        BatchCall call = {sb, NULL, 0, NULL, 0};
+        call.n    = (size_t)batch_collect(ary, start, chunk, strs, keybuf, bytebuf);
+        call.keys = (const BloomKey *)RSTRING_PTR(keybuf);
+
+        if (nogvl)
+            rb_thread_call_without_gvl(batch_add_nogvl, &call, NULL, NULL);
+        else
+            call.rc = scalable_add_locked(sb, call.keys, call.n, NULL, 1);
+
+        if (call.rc != BATCH_OK) batch_raise(call.rc);
+    }
+
+    RB_GC_GUARD(strs);
+    RB_GC_GUARD(keybuf);
+    RB_GC_GUARD(bytebuf);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   filter.include?("element")   #=> true / false
+ *   filter.member?("element")    #=> true / false
+ *
+ * Checks all layers. Returns true if ANY layer says "possibly yes".
+ * The key is hashed once; every layer probes with the same pair.
+ */
+static VALUE bloom_include(VALUE self, VALUE str) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    Check_Type(str, T_STRING);
+
+    bloom_lock(sb, 0);
+
+    BloomHash h;
+    bloom_hash(&h, RSTRING_PTR(str), RSTRING_LEN(str), sb->hash64);
+    int hit = scalable_include(sb, &h);
+    __atomic_fetch_add(&sb->lookups, 1, __ATOMIC_RELAXED);
+    if (hit) __atomic_fetch_add(&sb->positives, 1, __ATOMIC_RELAXED);
+
+    bloom_unlock(sb);
+    return hit ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   filter.delete("element")  #=> true if it was taken out, else false
+ *
+ * Counting filters only (layout: :counting). Decrements the key's
+ * counters and count in the layer add put it in (the oldest layer
+ * holding it), so a key added twice takes two deletes, even across a
+ * rollover. Only delete keys that were added: taking out a false
+ * positive lowers other keys' counters. Counters that saturated stay
+ * set, and keys in layers merged in from a bit filter stay for good.
+ */
+static VALUE bloom_delete(VALUE self, VALUE str) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    Check_Type(str, T_STRING);
+    bloom_check_writable(sb);
+    if (sb->layout != LAYOUT_COUNTING)
+        rb_raise(rb_eNotImpError, "delete needs a filter created with layout: :counting");
+
+    bloom_lock(sb, 1);
+
+    BloomHash h;
+    bloom_hash(&h, RSTRING_PTR(str), RSTRING_LEN(str), sb->hash64);
+
+    BloomLayer *home    = counting_home(sb, &h);
+    int         removed = home->layout == LAYOUT_COUNTING && layer_include(home, &h);
+    if (removed) {
+        layer_remove(home, &h);
+        if (sb->total_count) sb->total_count--;
+    }
+
+    bloom_unlock(sb);
+    return removed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   filter.include_many(keys)                   #=> [true, false, ...]
+ *   filter.include_many(keys, format: :bitmap)  #=> "\x05..." (binary String)
+ *
+ * Batch lookup. With format: :bitmap the answer for keys[i] is bit
+ * (i % 8) of byte (i / 8), least significant bit first, so
+ * result.unpack1("b*") yields one "0"/"1" per key. Batches of
+ * NOGVL_MIN_KEYS keys or more release the GVL while they work.
+ * Non-String elements are converted with #to_s.
+ */
+static VALUE bloom_include_many(int argc, VALUE *argv, VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    VALUE ary, opts = Qnil;
+    rb_scan_args(argc, argv, "11", &ary, &opts);
+    Check_Type(ary, T_ARRAY);
+
+    int bitmap = 0;
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE v = rb_hash_aref(opts, ID2SYM(rb_intern("format")));
+        if (v == ID2SYM(rb_intern("bitmap")))
+            bitmap = 1;
+        else if (!NIL_P(v) && v != ID2SYM(rb_intern("array")))
+            rb_raise(rb_eArgError, "format must be :array or :bitmap");
+    }
+
+    check_not_streaming(sb);
+
+    long  total  = RARRAY_LEN(ary);
+    VALUE result = bitmap ? rb_str_new(NULL, (total + 7) / 8) : rb_ary_new_capa(total);
+    if (bitmap) memset(RSTRING_PTR(result), 0, (total + 7) / 8);
+
+    int   nogvl   = total >= NOGVL_MIN_KEYS;
+    long  chunk   = nogvl ? NOGVL_CHUNK : BATCH_CHUNK;
+    VALUE strs    = rb_ary_new_capa(chunk);
+    VALUE keybuf  = rb_str_buf_new(chunk * (long)sizeof(BloomKey));
+    VALUE bytebuf = rb_str_buf_new(0);
+    VALUE hitbuf  = rb_str_new(NULL, chunk / 8);
+
+    /* #to_s may run Ruby code, so stop at the length seen up front */
+    for (long start = 0; start < total && start < RARRAY_LEN(ary); start += chunk) {
+        BatchCall call = {sb, NULL, 0, NULL, 0};
+        long n = batch_collect(ary, start, chunk, strs, keybuf, bytebuf);
+        if (start + n > total) n = total - start;
+
+        call.n    = (size_t)n;
+        call.keys = (const BloomKey *)RSTRING_PTR(keybuf);
+        call.out  = (uint8_t *)RSTRING_PTR(hitbuf);
+        memset(call.out, 0, (size_t)chunk / 8);
+
+        if (nogvl) {
+            rb_thread_call_without_gvl(batch_include_nogvl, &call, NULL, NULL);
+        } else {
+            bloom_lock(sb, 0);
+            scalable_include_batch(sb, call.keys, call.n, call.out);
+            bloom_unlock(sb);
+        }
+
+        if (bitmap) {
+            /* chunks are a multiple of 8 keys: each starts on a byte */
+            memcpy(RSTRING_PTR(result) + start / 8, call.out, (size_t)(n + 7) / 8);
+        } else {
+            for (long i = 0; i < n; i++)
+                rb_ary_push(result, get_bit(call.out, (size_t)i) ? Qtrue : Qfalse);
+        }
+    }
+
+    RB_GC_GUARD(strs);
+    RB_GC_GUARD(keybuf);
+    RB_GC_GUARD(bytebuf);
+    RB_GC_GUARD(hitbuf);
+    return result;
+}
+
+/*
+ * Reset all layers, keep only one fresh layer.
+ */
+static VALUE bloom_clear(VALUE self) {
     ScalableBloom *sb;
     TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
 
+    if (sb->map)
+        rb_raise(rb_eIOError, "clear is not supported on a mapped filter");
+
+    bloom_lock(sb, 1);
+
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        layer_release(&sb->layers[i]);
+    }
+    arena_free(sb);
+    sb->num_layers  = 0;
+    sb->total_count = 0;
+    sb->hash64      = 0;
+
+    BloomLayer *layer = scalable_add_layer(sb);
+
+    /* Every page changed: the next checkpoint carries the whole layer,
+     * and a replica still holding more layers refuses it.            */
+    for (size_t pg = 0; layer && layer->dirty && pg < layer_pages(layer); pg++)
+        set_bit(layer->dirty, pg);
+    bloom_unlock(sb);
+
+    if (!layer)
+        rb_raise(rb_eNoMemError, "failed to allocate layer after clear");
+
+    return Qnil;
+}
+
+static VALUE bloom_unlock_value(VALUE ptr) {
+    bloom_unlock((ScalableBloom *)ptr);
+    return Qnil;
+}
+
+static VALUE bloom_stats_locked(VALUE ptr) {
+    ScalableBloom *sb = (ScalableBloom *)ptr;
+
     size_t total_bytes    = 0;
     size_t total_bits     = 0;
     size_t total_bits_set = 0;
+    size_t dirty_pages    = 0;
+    double cardinality    = 0;
+    size_t counters_set   = 0;  /* counting layers only */
+    size_t saturated      = 0;
+    int    counting       = 0;
 
     VALUE layers_ary = rb_ary_new_capa((long)sb->num_layers);
 
     for (size_t i = 0; i < sb->num_layers; i++) {
-        BloomLayer *l = sb->layers[i];
+        BloomLayer *l = &sb->layers[i];
         size_t bs = layer_bits_set(l);
-        size_t tb = l->size * 8;
+        size_t tb = layer_filter_bits(l);
 
         total_bytes    += l->size;
         total_bits     += tb;
         total_bits_set += bs;
+        double card     = layer_cardinality(l, bs);
+        cardinality    += card;
+        for (size_t pg = 0; l->dirty && pg < layer_pages(l); pg++)
+            dirty_pages += get_bit(l->dirty, pg);
 
         VALUE lh = rb_hash_new();
         rb_hash_aset(lh, ID2SYM(rb_intern("layer")),      LONG2NUM(i));
@@ -448,11 +2899,31 @@ static VALUE bloom_stats(VALUE self) {
         rb_hash_aset(lh, ID2SYM(rb_intern("count")),       LONG2NUM(l->count));
         rb_hash_aset(lh, ID2SYM(rb_intern("size_bytes")),  LONG2NUM(l->size));
         rb_hash_aset(lh, ID2SYM(rb_intern("num_hashes")),  INT2NUM(l->num_hashes));
+        rb_hash_aset(lh, ID2SYM(rb_intern("layout")),      layout_to_sym(l->layout));
+        rb_hash_aset(lh, ID2SYM(rb_intern("sizing")),      sizing_to_sym(l->sizing));
+        rb_hash_aset(lh, ID2SYM(rb_intern("requested_bits")), LONG2NUM(l->requested_bits));
+        rb_hash_aset(lh, ID2SYM(rb_intern("hash_bits")),   INT2NUM(l->hash64 ? 64 : 32));
+        rb_hash_aset(lh, ID2SYM(rb_intern("backing")),     backing_to_sym(l->backing));
+        rb_hash_aset(lh, ID2SYM(rb_intern("pages")),
+                     pages_to_sym(l->backing == BACKING_ARENA ? arena_pages(sb, l->bits)
+                                                              : HUGE_PAGES_NONE));
         rb_hash_aset(lh, ID2SYM(rb_intern("bits_set")),    LONG2NUM(bs));
         rb_hash_aset(lh, ID2SYM(rb_intern("total_bits")),  LONG2NUM(tb));
         rb_hash_aset(lh, ID2SYM(rb_intern("fill_ratio")),  DBL2NUM((double)bs / tb));
+        rb_hash_aset(lh, ID2SYM(rb_intern("estimated_cardinality")), LL2NUM(llround(card)));
         rb_hash_aset(lh, ID2SYM(rb_intern("error_rate")),
                      DBL2NUM(layer_error_rate(sb->error_rate, sb->tightening, i)));
+        rb_hash_aset(lh, ID2SYM(rb_intern("expected_fpr")), DBL2NUM(layer_expected_fpr(l)));
+
+        if (l->layout == LAYOUT_COUNTING) {
+            size_t sat = layer_saturated(l);
+            counting      = 1;
+            counters_set += bs;
+            saturated    += sat;
+            rb_hash_aset(lh, ID2SYM(rb_intern("saturated_counters")), LONG2NUM(sat));
+            rb_hash_aset(lh, ID2SYM(rb_intern("counter_overflow_rate")),
+                         DBL2NUM(bs ? (double)sat / bs : 0.0));
+        }
 
         rb_ary_push(layers_ary, lh);
     }
@@ -464,10 +2935,88 @@ static VALUE bloom_stats(VALUE self) {
     rb_hash_aset(hash, ID2SYM(rb_intern("total_bits")),     LONG2NUM(total_bits));
     rb_hash_aset(hash, ID2SYM(rb_intern("total_bits_set")), LONG2NUM(total_bits_set));
     rb_hash_aset(hash, ID2SYM(rb_intern("fill_ratio")),     DBL2NUM((double)total_bits_set / total_bits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("estimated_cardinality")), LL2NUM(llround(cardinality)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("rollover")),
+                 ID2SYM(rb_intern(sb->rollover == ROLLOVER_FILL ? "fill" : "count")));
     rb_hash_aset(hash, ID2SYM(rb_intern("error_rate")),     DBL2NUM(sb->error_rate));
+    rb_hash_aset(hash, ID2SYM(rb_intern("layout")),         layout_to_sym(sb->layout));
+    rb_hash_aset(hash, ID2SYM(rb_intern("sizing")),         sizing_to_sym(sb->sizing));
+    rb_hash_aset(hash, ID2SYM(rb_intern("growth")),
+                 ID2SYM(rb_intern(sb->growth == GROWTH_ADAPTIVE ? "adaptive" : "fixed")));
+    rb_hash_aset(hash, ID2SYM(rb_intern("expected_total")),
+                 sb->expected_total ? LONG2NUM(sb->expected_total) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("concurrent")),     sb->concurrent ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("shared")),         sb->shared ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("dirty_pages")),
+                 sb->track_changes ? LONG2NUM(dirty_pages) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("counter_overflow_rate")),
+                 counting ? DBL2NUM(counters_set ? (double)saturated / counters_set : 0.0) : Qnil);
     rb_hash_aset(hash, ID2SYM(rb_intern("layers")),         layers_ary);
 
-    return hash;
+    return hash;
+}
+
+/*
+ * Detailed statistics for the whole filter and each layer.
+ */
+static VALUE bloom_stats(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    bloom_lock(sb, 0);
+    return rb_ensure(bloom_stats_locked, (VALUE)sb, bloom_unlock_value, (VALUE)sb);
+}
+
+/* Keys of Filter#metrics, interned once in Init_fast_bloom_filter() */
+static VALUE sym_adds, sym_lookups, sym_positives, sym_count, sym_num_layers,
+             sym_bytes, sym_estimated_fpr, sym_layer_counts, sym_layer_bytes;
+
+static VALUE bloom_metrics_locked(VALUE ptr) {
+    ScalableBloom *sb = (ScalableBloom *)ptr;
+
+    VALUE  counts = rb_ary_new_capa((long)sb->num_layers);
+    VALUE  bytes  = rb_ary_new_capa((long)sb->num_layers);
+    size_t total  = 0;
+    double miss   = 1.0;  /* probability that no layer reports a false positive */
+
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        rb_ary_push(counts, SIZET2NUM(l->count));
+        rb_ary_push(bytes,  SIZET2NUM(l->size));
+        total += l->size;
+        miss  *= 1.0 - layer_fpr_at(l, l->count);
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym_adds,          ULL2NUM(sb->adds));
+    rb_hash_aset(hash, sym_lookups,       ULL2NUM(sb->lookups));
+    rb_hash_aset(hash, sym_positives,     ULL2NUM(sb->positives));
+    rb_hash_aset(hash, sym_count,         SIZET2NUM(sb->total_count));
+    rb_hash_aset(hash, sym_num_layers,    SIZET2NUM(sb->num_layers));
+    rb_hash_aset(hash, sym_bytes,         SIZET2NUM(total));
+    rb_hash_aset(hash, sym_estimated_fpr, DBL2NUM(1.0 - miss));
+    rb_hash_aset(hash, sym_layer_counts,  rb_obj_freeze(counts));
+    rb_hash_aset(hash, sym_layer_bytes,   rb_obj_freeze(bytes));
+    return rb_obj_freeze(hash);
+}
+
+/*
+ * call-seq:
+ *   filter.metrics   #=> {adds: 1200, lookups: 50000, positives: 812, ...}
+ *
+ * Counters for monitoring, as a frozen Hash: adds (keys inserted;
+ * add? calls that found the key are not counted), lookups and
+ * positives since the filter was created or loaded, count,
+ * num_layers, bytes, estimated_fpr (from each layer's count, not its
+ * bits) and the per-layer layer_counts and layer_bytes. Costs
+ * O(layers) and never reads the bit arrays, unlike #stats.
+ */
+static VALUE bloom_metrics(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    bloom_lock(sb, 0);
+    return rb_ensure(bloom_metrics_locked, (VALUE)sb, bloom_unlock_value, (VALUE)sb);
 }
 
 /*
@@ -479,6 +3028,27 @@ static VALUE bloom_count(VALUE self) {
     return LONG2NUM(sb->total_count);
 }
 
+/*
+ * call-seq:
+ *   filter.estimated_cardinality   #=> 9_874
+ *
+ * Distinct keys, estimated from how many bits each layer has set
+ * (Swamidass–Baldi), summed over the layers. Unlike #count it does
+ * not grow when a key is added again to the same layer.
+ */
+static VALUE bloom_estimated_cardinality(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    bloom_lock(sb, 0);
+    double n = 0;
+    for (size_t i = 0; i < sb->num_layers; i++)
+        n += layer_cardinality(&sb->layers[i], layer_bits_set(&sb->layers[i]));
+    bloom_unlock(sb);
+
+    return LL2NUM(llround(n));
+}
+
 /*
  * Number of layers currently allocated.
  */
@@ -488,43 +3058,906 @@ static VALUE bloom_num_layers(VALUE self) {
     return LONG2NUM(sb->num_layers);
 }
 
+/*
+ * call-seq:
+ *   filter.compact!(keys)   #=> filter
+ *   filter.compact!         #=> filter
+ *
+ * Cuts the number of layers every miss has to probe.
+ *
+ * With keys (an Array, or anything with #to_a), the filter is rebuilt
+ * as a single layer sized for max(keys.size, initial_capacity) at the
+ * first layer's error rate, and the keys are re-inserted. Bloom layers
+ * cannot be enumerated, so the keys must cover everything the filter
+ * should still contain; anything else, including keys added by other
+ * threads while the rebuild runs, is dropped. The new layer is built
+ * aside and swapped in, so lookups keep working meanwhile.
+ *
+ * Without keys, layers of identical geometry (as merge! leaves behind)
+ * are ORed together while their counts fit one layer's capacity.
+ *
+ * Both forms restart change tracking: take a new base snapshot before
+ * the next checkpoint.
+ */
+static VALUE bloom_compact(int argc, VALUE *argv, VALUE self) {
+    VALUE keys = Qnil;
+    rb_scan_args(argc, argv, "01", &keys);
+
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    if (sb->map)
+        rb_raise(rb_eIOError, "compact! is not supported on a mapped filter");
+
+    if (NIL_P(keys)) {
+        bloom_lock(sb, 1);
+        scalable_fold_layers(sb);
+        int rc = sb->track_changes ? scalable_track_changes(sb) : 0;
+        bloom_unlock(sb);
+
+        if (rc != 0) rb_raise(rb_eNoMemError, "failed to allocate dirty page map");
+        return self;
+    }
+
+    VALUE ary = rb_check_array_type(keys);
+    if (NIL_P(ary)) ary = rb_convert_type(keys, T_ARRAY, "Array", "to_a");
+
+    VALUE tmp_obj = rb_obj_alloc(rb_obj_class(self));
+    ScalableBloom *tmp;
+    TypedData_Get_Struct(tmp_obj, ScalableBloom, &scalable_bloom_type, tmp);
+
+    tmp->error_rate       = sb->error_rate;
+    tmp->tightening       = sb->tightening;
+    tmp->initial_capacity = sb->initial_capacity;
+    tmp->layout           = sb->layout;
+    tmp->sizing           = sb->sizing;
+    tmp->prefetch_window  = sb->prefetch_window;
+    tmp->huge_pages       = sb->huge_pages;
+    tmp->growth           = sb->growth;
+    tmp->expected_total   = sb->expected_total;
+    tmp->growth_horizon   = sb->growth_horizon;
+    tmp->rollover         = sb->rollover;
+
+    size_t cap = (size_t)RARRAY_LEN(ary);
+    if (cap < sb->initial_capacity) cap = sb->initial_capacity;
+    if (!scalable_add_layer_sized(tmp, cap))
+        rb_raise(rb_eNoMemError, "failed to allocate layer");
+    bloom_add_many(tmp_obj, ary);
+
+    bloom_lock(sb, 1);
+
+    for (size_t i = 0; i < sb->num_layers; i++)
+        layer_release(&sb->layers[i]);
+    free(sb->layers);
+    arena_free(sb);
+
+    sb->layers      = tmp->layers;
+    sb->num_layers  = tmp->num_layers;
+    sb->layers_cap  = tmp->layers_cap;
+    sb->arena       = tmp->arena;
+    sb->total_count = tmp->total_count;
+    sb->hash64      = tmp->hash64;
+    sb->layer_started = tmp->layer_started;
+    for (size_t i = 0; i < sb->num_layers; i++)
+        sb->layers[i].atomic = sb->concurrent;
+
+    tmp->layers     = NULL;
+    tmp->num_layers = 0;
+    tmp->layers_cap = 0;
+    tmp->arena      = NULL;
+
+    int rc = sb->track_changes ? scalable_track_changes(sb) : 0;
+    bloom_unlock(sb);
+
+    RB_GC_GUARD(tmp_obj);
+    if (rc != 0) rb_raise(rb_eNoMemError, "failed to allocate dirty page map");
+    return self;
+}
+
+/*
+ * Number of keys batch operations keep in flight (1 disables the
+ * pipeline).
+ */
+static VALUE bloom_prefetch_window(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+    return LONG2NUM(sb->prefetch_window);
+}
+
+static VALUE bloom_set_prefetch_window(VALUE self, VALUE window) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    long w = NUM2LONG(window);
+    if (w < 1 || w > MAX_PREFETCH_WINDOW)
+        rb_raise(rb_eArgError, "prefetch_window must be between 1 and %d", MAX_PREFETCH_WINDOW);
+
+    sb->prefetch_window = (size_t)w;
+    return window;
+}
+
 /*
  * Merge another scalable filter into this one.
  * Appends all layers from `other` (copies the bit arrays).
+ *
+ * The copies are taken under `other`'s lock and appended under ours,
+ * so the two locks are never held together.
  */
 static VALUE bloom_merge(VALUE self, VALUE other) {
     ScalableBloom *sb1, *sb2;
     TypedData_Get_Struct(self,  ScalableBloom, &scalable_bloom_type, sb1);
     TypedData_Get_Struct(other, ScalableBloom, &scalable_bloom_type, sb2);
 
-    for (size_t i = 0; i < sb2->num_layers; i++) {
-        BloomLayer *src = sb2->layers[i];
+    if (sb1->map)
+        rb_raise(rb_eIOError, "merge! is not supported into a mapped filter");
 
-        /* Create a copy of the layer */
-        BloomLayer *copy = (BloomLayer *)calloc(1, sizeof(BloomLayer));
-        if (!copy) rb_raise(rb_eNoMemError, "failed to allocate layer copy");
+    bloom_lock(sb2, 0);
 
-        copy->size       = src->size;
-        copy->capacity   = src->capacity;
-        copy->count      = src->count;
-        copy->num_hashes = src->num_hashes;
-        copy->bits       = (uint8_t *)malloc(src->size);
-        if (!copy->bits) { free(copy); rb_raise(rb_eNoMemError, "failed to allocate bits"); }
+    size_t n = sb2->num_layers, done = 0;
+    size_t count = sb2->total_count;
+    BloomLayer *copies = (BloomLayer *)calloc(n, sizeof(BloomLayer));
+
+    for (; copies && done < n; done++) {
+        BloomLayer *src  = &sb2->layers[done];
+        BloomLayer *copy = &copies[done];
+
+        *copy         = *src;  /* geometry, counters */
+        copy->backing = BACKING_HEAP;
+        copy->map     = NULL;
+        copy->map_len = 0;
+        copy->dirty   = NULL;
+        copy->bits    = bits_alloc(src->size);
+        if (!copy->bits) break;
         memcpy(copy->bits, src->bits, src->size);
+        layer_recount(copy);
+
+        /* A merged layer is new to our checkpoints: all of it is dirty */
+        if (sb1->track_changes) {
+            copy->dirty = bits_alloc(layer_dirty_bytes(copy));
+            if (!copy->dirty) { layer_release(copy); break; }
+            for (size_t pg = 0; pg < layer_pages(copy); pg++) set_bit(copy->dirty, pg);
+        }
+    }
+
+    bloom_unlock(sb2);
+
+    if (done < n) {
+        for (size_t i = 0; i < done; i++) layer_release(&copies[i]);
+        free(copies);
+        rb_raise(rb_eNoMemError, "failed to allocate layer copy");
+    }
+
+    bloom_lock(sb1, 1);
+
+    /* Grow layers array if needed */
+    size_t slots = sb1->layers_cap == 0 ? 4 : sb1->layers_cap;
+    while (slots < sb1->num_layers + n) slots *= 2;
+    if (slots != sb1->layers_cap) {
+        BloomLayer *tmp = (BloomLayer *)realloc(sb1->layers, slots * sizeof(BloomLayer));
+        if (!tmp) {
+            bloom_unlock(sb1);
+            for (size_t i = 0; i < n; i++) layer_release(&copies[i]);
+            free(copies);
+            rb_raise(rb_eNoMemError, "realloc failed");
+        }
+        sb1->layers     = tmp;
+        sb1->layers_cap = slots;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        scalable_push_layer(sb1, &copies[i]);
+    sb1->total_count += count;
+
+    bloom_unlock(sb1);
+    free(copies);
+    return self;
+}
+
+typedef struct {
+    ScalableBloom *sb;
+    int compress;
+} DumpCall;
+
+static VALUE bloom_dump_locked(VALUE ptr) {
+    DumpCall      *call  = (DumpCall *)ptr;
+    ScalableBloom *sb    = call->sb;
+    LayerPlan     *plans = NULL;
+
+    if (call->compress) {
+        plans = ALLOCA_N(LayerPlan, sb->num_layers);
+        snapshot_plan(sb, plans);
+    }
+
+    size_t len = snapshot_size(sb, plans);
+    VALUE  str = rb_str_new(NULL, (long)len);
+
+    memset(RSTRING_PTR(str), 0, len);
+    if (snapshot_write(sb, plans, (uint8_t *)RSTRING_PTR(str)) != 0) {
+        len = snapshot_size(sb, NULL);
+        rb_str_resize(str, (long)len);
+        memset(RSTRING_PTR(str), 0, len);
+        snapshot_write(sb, NULL, (uint8_t *)RSTRING_PTR(str));
+    }
+    return str;
+}
+
+/* A compressed dump is planned, then written: adds in between would
+ * outgrow the plan, so it locks writers out. So does any dump of a
+ * concurrent filter, whose writers only take the lock shared: the
+ * bits and counts written then agree.                                */
+static inline int dump_exclusive(const ScalableBloom *sb, int compress) {
+    return compress || sb->concurrent;
+}
+
+static VALUE filter_dump(VALUE self, int compress) {
+    DumpCall call;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, call.sb);
+    call.compress = compress;
+
+    bloom_lock(call.sb, dump_exclusive(call.sb, compress));
+    return rb_ensure(bloom_dump_locked, (VALUE)&call, bloom_unlock_value, (VALUE)call.sb);
+}
+
+static int compress_option(VALUE opts) {
+    if (NIL_P(opts)) return 0;
+    Check_Type(opts, T_HASH);
+    return RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("compress"))));
+}
+
+/*
+ * call-seq:
+ *   filter.dump                  -> String
+ *   filter.dump(compress: true)  -> String
+ *
+ * Binary snapshot of the whole filter: configuration, counters and every
+ * layer's bits. Restore it with Filter.load. With compress: true, sparse
+ * layers are stored as gaps between set bits when that is smaller (such
+ * snapshots load with Filter.load but cannot be mapped). Layers that
+ * other processes write, after share!(writers: true), are kept raw.
+ */
+static VALUE bloom_dump(int argc, VALUE *argv, VALUE self) {
+    VALUE opts = Qnil;
+    rb_scan_args(argc, argv, "01", &opts);
+    return filter_dump(self, compress_option(opts));
+}
+
+/* Marshal snapshots travel over the wire: always compressed */
+static VALUE bloom_marshal_dump(int argc, VALUE *argv, VALUE self) {
+    rb_check_arity(argc, 0, 1);  /* Marshal passes the depth limit */
+    return filter_dump(self, 1);
+}
+
+/*
+ * call-seq:
+ *   Filter.load(string)  -> Filter
+ *
+ * Rebuilds a filter from Filter#dump output with one bulk copy per layer.
+ * Raises ArgumentError if the string is not a valid snapshot.
+ */
+static VALUE bloom_load(VALUE klass, VALUE str) {
+    StringValue(str);
+
+    VALUE obj = rb_obj_alloc(klass);
+    ScalableBloom *sb;
+    TypedData_Get_Struct(obj, ScalableBloom, &scalable_bloom_type, sb);
+
+    const char *err = NULL;
+    if (snapshot_load(sb, (const uint8_t *)RSTRING_PTR(str), (size_t)RSTRING_LEN(str), BACKING_HEAP, &err) != 0) {
+        RB_GC_GUARD(str);
+        rb_raise(rb_eArgError, "%s", err);
+    }
+
+    RB_GC_GUARD(str);
+    return obj;
+}
+
+typedef struct {
+    ScalableBloom *sb;
+    VALUE  io;
+    size_t chunk;
+    int    compress;
+    StreamHold hold;
+} StreamCall;
+
+/* One frame: a fresh String per chunk, since an IO-like object may keep
+ * the String it was given.                                           */
+static void stream_write_frame(VALUE io, const uint8_t *head, size_t head_len,
+                               const uint8_t *data, size_t len) {
+    VALUE    str = rb_str_new(NULL, (long)(STREAM_FRAME_BYTES + head_len + len));
+    uint8_t *p   = (uint8_t *)RSTRING_PTR(str);
+
+    if (head_len) memcpy(p + STREAM_FRAME_BYTES, head, head_len);
+    if (len)      memcpy(p + STREAM_FRAME_BYTES + head_len, data, len);
+    put_u32(p, (uint32_t)(head_len + len));
+    put_u32(p + 4, crc32_update(0, p + STREAM_FRAME_BYTES, head_len + len));
+    rb_funcall(io, rb_intern("write"), 1, str);
+}
+
+/* Magic, version, then a frame with the snapshot header and table */
+static void stream_write_head(VALUE io, const char *magic, const ScalableBloom *sb,
+                              const LayerPlan *plans) {
+    uint8_t word[8];
+    memcpy(word, magic, 4);
+    put_u32(word + 4, STREAM_VERSION);
+    rb_funcall(io, rb_intern("write"), 1, rb_str_new((const char *)word, 8));
+
+    size_t table_len = snapshot_table_size(sb);
+    VALUE  head      = rb_str_new(NULL, (long)(8 + table_len));
+    memset(RSTRING_PTR(head), 0, 8 + table_len);
+    put_u64((uint8_t *)RSTRING_PTR(head), snapshot_size(sb, plans));
+    snapshot_write_table(sb, plans, (uint8_t *)RSTRING_PTR(head) + 8);
+    stream_write_frame(io, (const uint8_t *)RSTRING_PTR(head), (size_t)RSTRING_LEN(head),
+                       NULL, 0);
+    RB_GC_GUARD(head);
+}
+
+static VALUE bloom_dump_to_locked(VALUE ptr) {
+    StreamCall    *call = (StreamCall *)ptr;
+    ScalableBloom *sb   = call->sb;
+
+    LayerPlan *plans = NULL;
+    if (call->compress) {
+        plans = ALLOCA_N(LayerPlan, sb->num_layers);
+        snapshot_plan(sb, plans);
+    }
+
+    stream_write_head(call->io, STREAM_MAGIC, sb, plans);
+
+    /* DELTA layers: encode a chunk at a time into a scratch String */
+    VALUE scratch = call->compress ? rb_str_buf_new((long)call->chunk) : Qnil;
+
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+
+        if (!plans || plans[i].encoding == SNAPSHOT_RAW) {
+            for (size_t off = 0; off < l->size; off += call->chunk) {
+                size_t len = l->size - off < call->chunk ? l->size - off : call->chunk;
+                stream_write_frame(call->io, NULL, 0, l->bits + off, len);
+            }
+            continue;
+        }
+
+        DeltaCursor c = {0, 0, 0};
+        uint8_t    *buf = (uint8_t *)RSTRING_PTR(scratch);
+        size_t      len = (size_t)(put_varint(buf, plans[i].bits_set) - buf);
+        size_t      sent = 0;
+        for (;;) {
+            buf  = (uint8_t *)RSTRING_PTR(scratch);
+            len += delta_encode(l->bits, l->size, &c, buf + len, call->chunk - len);
+            if (c.byte == l->size || len + DELTA_HEADROOM > call->chunk) {
+                /* The head already promised plans[i]: never send more */
+                if (len > plans[i].encoded - sent) break;
+                stream_write_frame(call->io, NULL, 0, buf, len);
+                sent += len;
+                len   = 0;
+            }
+            if (c.byte == l->size) break;
+        }
+        if (sent != plans[i].encoded || c.set != plans[i].bits_set)
+            rb_raise(rb_eIOError, "filter changed while it was being streamed");
+    }
+    RB_GC_GUARD(scratch);
+
+    stream_write_frame(call->io, NULL, 0, NULL, 0);
+    return call->io;
+}
+
+/*
+ * call-seq:
+ *   filter.dump_to(io)                       -> io
+ *   filter.dump_to(io, chunk_size: 1 << 20)  -> io
+ *   filter.dump_to(io, compress: true)       -> io
+ *
+ * Streams the snapshot to anything that responds to #write (File,
+ * pipe, socket, StringIO) in frames of at most chunk_size bytes, each
+ * with a CRC-32. Memory stays at one chunk whatever the filter size.
+ * compress: true encodes sparse layers as in #dump.
+ */
+static VALUE bloom_dump_to(int argc, VALUE *argv, VALUE self) {
+    VALUE io, opts = Qnil;
+    long  chunk    = STREAM_DEFAULT_CHUNK;
+
+    rb_scan_args(argc, argv, "11", &io, &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE v = rb_hash_aref(opts, ID2SYM(rb_intern("chunk_size")));
+        if (!NIL_P(v)) chunk = NUM2LONG(v);
+    }
+    if (chunk < 2 * DELTA_HEADROOM || chunk > INT32_MAX)
+        rb_raise(rb_eArgError, "chunk_size must be between %d and %d", 2 * DELTA_HEADROOM, INT32_MAX);
+
+    StreamCall call;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, call.sb);
+    call.io       = io;
+    call.chunk    = (size_t)chunk;
+    call.compress = compress_option(opts);
+
+    stream_lock(call.sb, dump_exclusive(call.sb, call.compress), &call.hold);
+    return rb_ensure(bloom_dump_to_locked, (VALUE)&call, stream_unlock_value, (VALUE)&call.hold);
+}
+
+static VALUE stream_read(VALUE io, size_t len) {
+    VALUE str = rb_funcall(io, rb_intern("read"), 1, SIZET2NUM(len));
+    if (NIL_P(str) || (size_t)RSTRING_LEN(StringValue(str)) != len)
+        rb_raise(rb_eArgError, "truncated snapshot stream");
+    return str;
+}
+
+/* Reads one frame of at most `max` bytes and checks its CRC */
+static VALUE stream_read_frame(VALUE io, size_t max) {
+    VALUE head = stream_read(io, STREAM_FRAME_BYTES);
+    const uint8_t *h = (const uint8_t *)RSTRING_PTR(head);
+    size_t   len = get_u32(h);
+    uint32_t crc = get_u32(h + 4);
+
+    if (len > max)
+        rb_raise(rb_eArgError, "corrupt snapshot stream: frame too long");
+
+    VALUE data = len ? stream_read(io, len) : rb_str_new(NULL, 0);
+    if (crc32_update(0, (const uint8_t *)RSTRING_PTR(data), len) != crc)
+        rb_raise(rb_eArgError, "corrupt snapshot stream: checksum mismatch");
+    return data;
+}
+
+/*
+ * call-seq:
+ *   Filter.load_from(io)  -> Filter
+ *
+ * Reads a stream written by Filter#dump_to from anything that responds
+ * to #read, one frame at a time. Raises ArgumentError if the stream is
+ * truncated or a checksum does not match.
+ */
+/* Reads what stream_write_head() wrote into sb's configuration and
+ * returns the frame; the layer table starts 8 bytes into it and is
+ * validated against the snapshot size it describes (*snap_len).      */
+static VALUE stream_read_head(VALUE io, const char *magic, ScalableBloom *sb,
+                              size_t *snap_len, size_t *n) {
+    VALUE word = stream_read(io, 8);
+    if (memcmp(RSTRING_PTR(word), magic, 4) != 0)
+        rb_raise(rb_eArgError, "not a FastBloomFilter %s",
+                 memcmp(magic, STREAM_MAGIC, 4) == 0 ? "stream" : "checkpoint");
+    if (get_u32((const uint8_t *)RSTRING_PTR(word) + 4) != STREAM_VERSION)
+        rb_raise(rb_eArgError, "unsupported stream version");
+
+    VALUE head = stream_read_frame(io, STREAM_MAX_TABLE);
+    const uint8_t *table = (const uint8_t *)RSTRING_PTR(head);
+    size_t table_len = (size_t)RSTRING_LEN(head);
+    const char *err  = NULL;
+
+    if (table_len < 8 + SNAPSHOT_HEADER_BYTES)
+        rb_raise(rb_eArgError, "corrupt snapshot stream: short header");
+    *snap_len = (size_t)get_u64(table);
+    *n = snapshot_read_header(sb, table + 8, *snap_len, &err);
+    if (*n == 0) rb_raise(rb_eArgError, "%s", err);
+    if (table_len != 8 + SNAPSHOT_HEADER_BYTES + sb->map_slots * SNAPSHOT_LAYER_BYTES)
+        rb_raise(rb_eArgError, "corrupt snapshot stream: short layer table");
+    return head;
+}
+
+static VALUE bloom_load_from(VALUE klass, VALUE io) {
+    VALUE obj = rb_obj_alloc(klass);
+    ScalableBloom *sb;
+    TypedData_Get_Struct(obj, ScalableBloom, &scalable_bloom_type, sb);
+
+    size_t snap_len, n;
+    VALUE  head = stream_read_head(io, STREAM_MAGIC, sb, &snap_len, &n);
+    const uint8_t *table = (const uint8_t *)RSTRING_PTR(head);
+    const char    *err   = NULL;
+
+    sb->layers = (BloomLayer *)calloc(n, sizeof(BloomLayer));
+    if (!sb->layers) rb_raise(rb_eNoMemError, "failed to allocate layers");
+    sb->layers_cap = n;
+
+    for (size_t i = 0; i < n; i++) {
+        BloomLayer geometry;
+        int encoding;
+        if (snapshot_read_layer(&geometry, &encoding, table + 8, snap_len, i, &err) == 0)
+            rb_raise(rb_eArgError, "%s", err);
+
+        geometry.bits    = arena_alloc(sb, geometry.size);
+        geometry.backing = BACKING_ARENA;
+        if (!geometry.bits) rb_raise(rb_eNoMemError, "failed to allocate layer");
+        BloomLayer *layer = scalable_push_layer(sb, &geometry);
+
+        if (encoding == SNAPSHOT_DELTA) {
+            /* Never more bytes than the raw layer plus the count */
+            DeltaDecoder d    = {layer->bits, (uint64_t)layer->size * 8, 0, 0, 0, 0, 0};
+            size_t       left = layer->size + 10;
+            while (!delta_done(&d)) {
+                VALUE  data = stream_read_frame(io, left);
+                size_t len  = (size_t)RSTRING_LEN(data);
+                if (len == 0 || delta_decode(&d, (const uint8_t *)RSTRING_PTR(data), len) != 0)
+                    rb_raise(rb_eArgError, "corrupt snapshot stream: bad compressed layer");
+                left -= len;
+            }
+            continue;
+        }
+
+        for (size_t off = 0; off < layer->size; ) {
+            VALUE data = stream_read_frame(io, layer->size - off);
+            size_t len = (size_t)RSTRING_LEN(data);
+            if (len == 0)
+                rb_raise(rb_eArgError, "corrupt snapshot stream: empty frame inside a layer");
+            memcpy(layer->bits + off, RSTRING_PTR(data), len);
+            off += len;
+        }
+    }
+
+    if (RSTRING_LEN(stream_read_frame(io, 0)) != 0)
+        rb_raise(rb_eArgError, "corrupt snapshot stream: missing end frame");
+
+    for (size_t i = 0; i < sb->num_layers; i++)
+        layer_recount(&sb->layers[i]);
+
+    RB_GC_GUARD(head);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *   Filter.open_mmap(path)                      # read-only
+ *   Filter.open_mmap(path, mode: :read_write)
+ *
+ * Maps a file written with Filter#dump instead of reading it: the
+ * layers point straight into the mapping, so opening costs the same
+ * for any size and pages come in on first touch.
+ *
+ * Read-write filters set bits through the page cache; new layers are
+ * appended to the file. Call #sync to store the counters and flush.
+ */
+static VALUE bloom_open_mmap(int argc, VALUE *argv, VALUE klass) {
+    VALUE path, opts = Qnil;
+    int   writable   = 0;
+
+    rb_scan_args(argc, argv, "11", &path, &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE v = rb_hash_aref(opts, ID2SYM(rb_intern("mode")));
+        if (v == ID2SYM(rb_intern("read_write")))
+            writable = 1;
+        else if (!NIL_P(v) && v != ID2SYM(rb_intern("read_only")))
+            rb_raise(rb_eArgError, "mode must be :read_only or :read_write");
+    }
+    FilePathValue(path);
+
+    VALUE obj = rb_obj_alloc(klass);
+    ScalableBloom *sb;
+    TypedData_Get_Struct(obj, ScalableBloom, &scalable_bloom_type, sb);
+
+    int fd = rb_cloexec_open(RSTRING_PTR(path), writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) rb_sys_fail_str(path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        rb_sys_fail_str(path);
+    }
+    if ((size_t)st.st_size < SNAPSHOT_HEADER_BYTES) {
+        close(fd);
+        rb_raise(rb_eArgError, "not a FastBloomFilter snapshot: %s", RSTRING_PTR(path));
+    }
+
+    size_t len = (size_t)st.st_size;
+    void  *p   = mmap(NULL, len, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        rb_sys_fail_str(path);
+    }
+
+    sb->map       = (uint8_t *)p;
+    sb->map_len   = len;
+    sb->file_len  = len;
+    sb->read_only = !writable;
+    if (writable) sb->map_fd = fd;
+    else          close(fd);
+
+    const char *err = NULL;
+    if (snapshot_load(sb, sb->map, len, BACKING_MMAP, &err) != 0)
+        rb_raise(rb_eArgError, "%s: %s", err, RSTRING_PTR(path));
+
+    return obj;
+}
+
+/*
+ * Starts tracking which 4 KB pages of each layer change, with every page
+ * clean: call it right after taking the base snapshot (Filter.new takes
+ * track_changes: true to start from an empty filter instead).
+ */
+static VALUE bloom_track_changes(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    bloom_lock(sb, 1);
+    int rc = scalable_track_changes(sb);
+    bloom_unlock(sb);
+
+    if (rc != 0) rb_raise(rb_eNoMemError, "failed to allocate dirty page map");
+    return self;
+}
+
+static VALUE bloom_checkpoint_locked(VALUE ptr) {
+    StreamCall    *call = (StreamCall *)ptr;
+    ScalableBloom *sb   = call->sb;
+
+    uint8_t seq[8];
+    put_u64(seq, sb->checkpoint_seq + 1);
+    stream_write_head(call->io, CHECKPOINT_MAGIC, sb, NULL);
+    stream_write_frame(call->io, seq, sizeof seq, NULL, 0);
+
+    /* Runs of dirty pages, CHECKPOINT_RUN_PAGES at most per frame */
+    for (size_t i = 0; i < sb->num_layers; i++) {
+        const BloomLayer *l = &sb->layers[i];
+        size_t pages = layer_pages(l);
+
+        for (size_t pg = 0; pg < pages; ) {
+            if (!get_bit(l->dirty, pg)) { pg++; continue; }
+
+            size_t run = 1;
+            while (pg + run < pages && run < CHECKPOINT_RUN_PAGES && get_bit(l->dirty, pg + run))
+                run++;
+
+            size_t off = pg << DIRTY_PAGE_SHIFT;
+            size_t len = (run << DIRTY_PAGE_SHIFT) < l->size - off ? run << DIRTY_PAGE_SHIFT
+                                                                   : l->size - off;
+            uint8_t where[16] = {0};
+            put_u32(where, (uint32_t)i);
+            put_u64(where + 8, off);
+            stream_write_frame(call->io, where, sizeof where, l->bits + off, len);
+            pg += run;
+        }
+    }
+    stream_write_frame(call->io, NULL, 0, NULL, 0);
+
+    /* Everything made it out: start the next interval clean */
+    for (size_t i = 0; i < sb->num_layers; i++)
+        layer_track_changes(&sb->layers[i]);
+    sb->checkpoint_seq++;
+    return call->io;
+}
+
+/*
+ * call-seq:
+ *   filter.checkpoint(io)  -> io
+ *
+ * Writes only the pages changed since the previous checkpoint (or since
+ * change tracking started), plus the counters and any new layers'
+ * geometry, then marks every page clean. Filter#replay applies a chain
+ * of checkpoints onto the base snapshot.
+ */
+static VALUE bloom_checkpoint(VALUE self, VALUE io) {
+    StreamCall call = {NULL, io, 0, 0, {NULL, NULL}};
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, call.sb);
+
+    if (!call.sb->track_changes)
+        rb_raise(rb_eRuntimeError,
+                 "change tracking is off: use Filter.new(track_changes: true) or #track_changes!");
+
+    stream_lock(call.sb, 1, &call.hold);
+    return rb_ensure(bloom_checkpoint_locked, (VALUE)&call, stream_unlock_value, (VALUE)&call.hold);
+}
+
+typedef struct {
+    ScalableBloom *sb;
+    VALUE io;
+    StreamHold hold;
+} ReplayCall;
+
+static VALUE bloom_replay_locked(VALUE ptr) {
+    ReplayCall    *call = (ReplayCall *)ptr;
+    ScalableBloom *sb   = call->sb;
+    ScalableBloom  cp;
+    size_t         snap_len, n;
+    const char    *err = NULL;
+
+    memset(&cp, 0, sizeof cp);
+    VALUE head = stream_read_head(call->io, CHECKPOINT_MAGIC, &cp, &snap_len, &n);
+    VALUE seq  = stream_read_frame(call->io, 8);
+
+    if (RSTRING_LEN(seq) != 8)
+        rb_raise(rb_eArgError, "corrupt checkpoint: missing sequence number");
+    uint64_t expected = sb->checkpoint_seq + 1;
+    uint64_t got      = get_u64((const uint8_t *)RSTRING_PTR(seq));
+    if (got != expected)
+        rb_raise(rb_eArgError, "checkpoint %llu is out of order (expected %llu)",
+                 (unsigned long long)got, (unsigned long long)expected);
+
+    if (cp.layout != sb->layout || cp.sizing != sb->sizing ||
+        cp.error_rate != sb->error_rate || cp.tightening != sb->tightening ||
+        n < sb->num_layers)
+        rb_raise(rb_eArgError, "checkpoint does not match this filter");
+
+    /* Layers we already have must match; later ones are created empty */
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *table = (const uint8_t *)RSTRING_PTR(head) + 8;
+        BloomLayer geometry;
+        int encoding;
+        if (snapshot_read_layer(&geometry, &encoding, table, snap_len, i, &err) == 0)
+            rb_raise(rb_eArgError, "%s", err);
+
+        if (i < sb->num_layers) {
+            BloomLayer *l = &sb->layers[i];
+            if (l->capacity != geometry.capacity || l->size != geometry.size ||
+                l->slots != geometry.slots || l->num_hashes != geometry.num_hashes ||
+                l->layout != geometry.layout || l->sizing != geometry.sizing)
+                rb_raise(rb_eArgError, "checkpoint does not match this filter");
+            l->count = geometry.count;
+            continue;
+        }
 
-        /* Append to layers array */
-        if (sb1->num_layers >= sb1->layers_cap) {
-            size_t new_slots = sb1->layers_cap == 0 ? 4 : sb1->layers_cap * 2;
-            BloomLayer **tmp = (BloomLayer **)realloc(sb1->layers,
-                                                       new_slots * sizeof(BloomLayer *));
-            if (!tmp) { layer_free(copy); rb_raise(rb_eNoMemError, "realloc failed"); }
-            sb1->layers     = tmp;
-            sb1->layers_cap = new_slots;
+        if (sb->map)
+            rb_raise(rb_eIOError, "replay cannot add layers to a mapped filter");
+        geometry.bits    = arena_alloc(sb, geometry.size);
+        geometry.backing = BACKING_ARENA;
+        if (!geometry.bits ||
+            (sb->track_changes && layer_track_changes(&geometry) != 0) ||
+            !scalable_push_layer(sb, &geometry)) {
+            layer_release(&geometry);
+            rb_raise(rb_eNoMemError, "failed to allocate layer");
         }
-        sb1->layers[sb1->num_layers++] = copy;
     }
+    sb->total_count    = cp.total_count;
+    sb->checkpoint_seq = got;
+
+    for (;;) {
+        VALUE  data = stream_read_frame(call->io, 16 + CHECKPOINT_RUN_PAGES * DIRTY_PAGE_BYTES);
+        size_t len  = (size_t)RSTRING_LEN(data);
+        if (len == 0) break;
+
+        const uint8_t *p = (const uint8_t *)RSTRING_PTR(data);
+        size_t i   = len >= 16 ? get_u32(p) : n;
+        size_t off = len >= 16 ? (size_t)get_u64(p + 8) : 0;
+        if (i >= n || off > sb->layers[i].size || len - 16 > sb->layers[i].size - off)
+            rb_raise(rb_eArgError, "corrupt checkpoint: page outside the filter");
+
+        BloomLayer *l = &sb->layers[i];
+        l->bits_set  -= layer_count_set(l, l->bits + off, len - 16);
+        l->saturated -= layer_count_saturated(l, l->bits + off, len - 16);
+        memcpy(l->bits + off, p + 16, len - 16);
+        l->bits_set  += layer_count_set(l, l->bits + off, len - 16);
+        l->saturated += layer_count_saturated(l, l->bits + off, len - 16);
+        for (size_t pg = off >> DIRTY_PAGE_SHIFT; l->dirty && pg << DIRTY_PAGE_SHIFT < off + len - 16; pg++)
+            set_bit(l->dirty, pg);
+    }
+
+    RB_GC_GUARD(head);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   filter.replay(io)  -> filter
+ *
+ * Applies a Filter#checkpoint onto this filter, which must hold the
+ * state the checkpoint was taken against (the base snapshot, then each
+ * earlier checkpoint in order). A corrupt checkpoint raises
+ * ArgumentError and leaves the filter partly updated.
+ */
+static VALUE bloom_replay(VALUE self, VALUE io) {
+    ReplayCall call = {NULL, io, {NULL, NULL}};
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, call.sb);
+    bloom_check_writable(call.sb);
+
+    stream_lock(call.sb, 1, &call.hold);
+    rb_ensure(bloom_replay_locked, (VALUE)&call, stream_unlock_value, (VALUE)&call.hold);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   filter.share!                   # read-only after the move
+ *   filter.share!(writers: true)    # atomic writers in every process
+ *
+ * Moves every layer into one anonymous MAP_SHARED region. Processes
+ * forked afterwards (Puma/Unicorn workers) inherit the region instead
+ * of copying the bits, so N workers cost one filter's worth of memory.
+ *
+ * The geometry is fixed from then on. Read-only sharing maps the region
+ * PROT_READ. With writers: true every process sets bits with atomic
+ * fetch-or, so adds are visible to all of them without a cross-process
+ * lock. New keys keep going into the last layer (no rollover), and
+ * counts are per process. Once that layer is full, judged by how many
+ * of its bits all the processes have set, adds raise RuntimeError
+ * instead of driving the false positive rate towards 1.
+ */
+static VALUE bloom_share(int argc, VALUE *argv, VALUE self) {
+    VALUE opts    = Qnil;
+    int   writers = 0;
+
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        writers = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("writers"))));
+    }
+
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    if (sb->map)
+        rb_raise(rb_eIOError, "filter is already mapped");
+
+    bloom_lock(sb, 1);
+
+    if (writers) sb->concurrent = 1;
+    size_t len = snapshot_size(sb, NULL);
+    void  *p   = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        int e = errno;
+        bloom_unlock(sb);
+        rb_syserr_fail(e, "mmap");
+    }
+    snapshot_write(sb, NULL, (uint8_t *)p);
+
+    for (size_t i = 0; i < sb->num_layers; i++)
+        layer_release(&sb->layers[i]);
+    free(sb->layers);
+    arena_free(sb);
+    sb->layers     = NULL;
+    sb->num_layers = 0;
+    sb->layers_cap = 0;
+    sb->hash64     = 0;
+
+    sb->map     = (uint8_t *)p;
+    sb->map_len = len;
+    sb->shared  = 1;
+
+    /* Other processes' writes would never reach our dirty maps */
+    sb->track_changes = 0;
+
+    /* The snapshot was written by us: re-reading it cannot fail short
+     * of running out of memory for the layer headers.                 */
+    const char *err = NULL;
+    int rc = snapshot_load(sb, sb->map, len, BACKING_SHARED, &err);
+
+    if (rc == 0 && !writers) {
+        mprotect(sb->map, len, PROT_READ);
+        sb->read_only = 1;
+    }
+
+    /* Writers judge fullness by the bits everyone set, published in the
+     * header, not by their own counts. Counting starts from zero in the
+     * shared layers, so the fill starts at what is already set.       */
+    if (rc == 0 && writers) {
+        BloomLayer *last = &sb->layers[sb->num_layers - 1];
+        if (!last->full_bits) last->full_bits = layer_fill_limit(last);
+        sb->shared_fill      = layer_count_set(last, last->bits, last->size);
+        sb->shared_published = 0;
+        put_u64(sb->map + SNAPSHOT_SHARED_FILL, sb->shared_fill);
+    }
+    bloom_unlock(sb);
+
+    if (rc != 0) rb_raise(rb_eNoMemError, "%s", err);
+    return self;
+}
+
+static void *bloom_sync_nogvl(void *ptr) {
+    ScalableBloom *sb = (ScalableBloom *)ptr;
+    return (void *)(intptr_t)(snapshot_sync(sb) == 0 ? 0 : errno);
+}
+
+/*
+ * Checkpoint of a filter opened with Filter.open_mmap(mode: :read_write):
+ * stores the counters in the file and flushes every mapped page (msync).
+ */
+static VALUE bloom_sync(VALUE self) {
+    ScalableBloom *sb;
+    TypedData_Get_Struct(self, ScalableBloom, &scalable_bloom_type, sb);
+
+    if (sb->map_fd < 0)
+        rb_raise(rb_eIOError, "filter is not mapped read-write");
+
+    bloom_lock(sb, 1);
+    if (snapshot_store_counts(sb) != 0) {
+        bloom_unlock(sb);
+        rb_raise(rb_eIOError, "layer table is full; dump the filter to a new file");
+    }
+    int e = (int)(intptr_t)rb_thread_call_without_gvl(bloom_sync_nogvl, sb, NULL, NULL);
+    bloom_unlock(sb);
 
-    sb1->total_count += sb2->total_count;
+    if (e != 0) rb_syserr_fail(e, "msync");
     return self;
 }
 
@@ -536,16 +3969,55 @@ void Init_fast_bloom_filter(void) {
     VALUE mFastBloomFilter = rb_define_module("FastBloomFilter");
     VALUE cFilter = rb_define_class_under(mFastBloomFilter, "Filter", rb_cObject);
 
+    sbbf_select_kernel();
+    popcount_select_kernel();
+    thp_detect();
+    crc32_init();
+    rb_define_const(mFastBloomFilter, "SIMD_KERNEL", rb_obj_freeze(rb_str_new_cstr(sbbf_kernel)));
+    rb_define_const(mFastBloomFilter, "POPCOUNT_KERNEL",
+                    rb_obj_freeze(rb_str_new_cstr(popcount_kernel)));
+
+    sym_adds          = ID2SYM(rb_intern("adds"));
+    sym_lookups       = ID2SYM(rb_intern("lookups"));
+    sym_positives     = ID2SYM(rb_intern("positives"));
+    sym_count         = ID2SYM(rb_intern("count"));
+    sym_num_layers    = ID2SYM(rb_intern("num_layers"));
+    sym_bytes         = ID2SYM(rb_intern("bytes"));
+    sym_estimated_fpr = ID2SYM(rb_intern("estimated_fpr"));
+    sym_layer_counts  = ID2SYM(rb_intern("layer_counts"));
+    sym_layer_bytes   = ID2SYM(rb_intern("layer_bytes"));
+
     rb_define_alloc_func(cFilter, bloom_alloc);
     rb_define_method(cFilter, "initialize",  bloom_initialize, -1);
     rb_define_method(cFilter, "add",         bloom_add,        1);
     rb_define_method(cFilter, "<<",          bloom_add,        1);
+    rb_define_method(cFilter, "add?",        bloom_add_p,      1);
+    rb_define_method(cFilter, "add_many",    bloom_add_many,   1);
     rb_define_method(cFilter, "include?",    bloom_include,    1);
     rb_define_method(cFilter, "member?",     bloom_include,    1);
+    rb_define_method(cFilter, "include_many", bloom_include_many, -1);
+    rb_define_method(cFilter, "delete",      bloom_delete,     1);
     rb_define_method(cFilter, "clear",       bloom_clear,      0);
     rb_define_method(cFilter, "stats",       bloom_stats,      0);
+    rb_define_method(cFilter, "metrics",     bloom_metrics,    0);
     rb_define_method(cFilter, "count",       bloom_count,      0);
     rb_define_method(cFilter, "size",        bloom_count,      0);
+    rb_define_method(cFilter, "estimated_cardinality", bloom_estimated_cardinality, 0);
     rb_define_method(cFilter, "num_layers",  bloom_num_layers, 0);
     rb_define_method(cFilter, "merge!",      bloom_merge,      1);
+    rb_define_method(cFilter, "compact!",    bloom_compact,    -1);
+    rb_define_method(cFilter, "prefetch_window",  bloom_prefetch_window,     0);
+    rb_define_method(cFilter, "prefetch_window=", bloom_set_prefetch_window, 1);
+    rb_define_method(cFilter, "dump",        bloom_dump,       -1);
+    rb_define_method(cFilter, "_dump",       bloom_marshal_dump, -1);
+    rb_define_singleton_method(cFilter, "load",  bloom_load,   1);
+    rb_define_singleton_method(cFilter, "_load", bloom_load,   1);
+    rb_define_method(cFilter, "dump_to",     bloom_dump_to,    -1);
+    rb_define_singleton_method(cFilter, "load_from", bloom_load_from, 1);
+    rb_define_singleton_method(cFilter, "open_mmap", bloom_open_mmap, -1);
+    rb_define_method(cFilter, "sync",        bloom_sync,       0);
+    rb_define_method(cFilter, "share!",      bloom_share,      -1);
+    rb_define_method(cFilter, "track_changes!", bloom_track_changes, 0);
+    rb_define_method(cFilter, "checkpoint",  bloom_checkpoint, 1);
+    rb_define_method(cFilter, "replay",      bloom_replay,     1);
 }
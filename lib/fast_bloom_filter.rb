@@ -18,12 +18,16 @@ end
 module FastBloomFilter
   class Filter
     def add_all(items)
-      items.each { |item| add(item.to_s) }
+      if items.is_a?(Array)
+        add_many(items)
+      else
+        items.each_slice(4096) { |slice| add_many(slice) }
+      end
       self
     end
 
     def count_possible_matches(items)
-      items.count { |item| include?(item.to_s) }
+      include_many(items.to_a, format: :bitmap).unpack1("b*").count("1")
     end
 
     def inspect
@@ -0,0 +1,952 @@
+require "minitest/autorun"
+require "fast_bloom_filter"
+require "rbconfig"
+require "stringio"
+require "tmpdir"
+
+class FastBloomFilterTest < Minitest::Test
+  Filter  = FastBloomFilter::Filter
+  LAYOUTS = %i[standard blocked split_block counting].freeze
+
+  def keys(prefix, n)
+    Array.new(n) { |i| "#{prefix}#{i}" }
+  end
+
+  # Small first layer, so that the keys spread over several layers
+  def filled(layout, n = 5_000, **opts)
+    f = Filter.new(initial_capacity: 1_000, layout: layout, **opts)
+    f.add_many(keys("k", n))
+    f
+  end
+
+  # Runs `script` in a child Ruby with FAST_BLOOM_FILTER_SIMD=scalar and
+  # returns whatever it printed with Marshal.
+  def in_scalar_process(script)
+    lib = File.expand_path("../lib", __dir__)
+    env = { "FAST_BLOOM_FILTER_SIMD" => "scalar" }
+    out = IO.popen(env, [RbConfig.ruby, "-I", lib, "-rfast_bloom_filter", "-e", script], "rb", &:read)
+    assert $?.success?
+    Marshal.load(out)
+  end
+
+  def comparable_stats(f)
+    f.stats.reject { |k, _| k == :dirty_pages }.tap do |s|
+      s[:layers] = s[:layers].map { |l| l.reject { |k, _| k == :backing || k == :pages } }
+    end
+  end
+
+  def assert_same_filter(expected, actual)
+    assert_equal expected.dump, actual.dump
+    assert_equal comparable_stats(expected), comparable_stats(actual)
+    assert actual.include_many(keys("k", expected.count)).all?
+  end
+
+  # Layer i's table entry: capacity, count, size, slots, bits, offset
+  def with_layer_field(dump, offset, value, layer = 0)
+    dump.b.tap { |d| d[128 + 64 * layer + offset, 8] = [value].pack("Q<") }
+  end
+
+  # Layer i's bit array, read back out of an uncompressed dump
+  def layer_bytes(dump, i)
+    size, _, _, offset = dump.b[128 + 64 * i + 16, 32].unpack("Q<4")
+    dump.b[offset, size]
+  end
+
+  def with_tmpfile
+    Dir.mktmpdir { |dir| yield File.join(dir, "filter.bloom") }
+  end
+
+  def test_add_and_include
+    f = Filter.new(initial_capacity: 1_000)
+    f.add("a")
+    f << "b"
+    assert f.include?("a")
+    assert f.member?("b")
+    refute f.include?("c")
+    assert_equal 2, f.count
+  end
+
+  # Every layer is probed with the one hash pair computed per key
+  def test_include_finds_keys_in_every_layer
+    f = Filter.new(initial_capacity: 100)
+    keys("k", 3_000).each { |k| f.add(k) }
+
+    assert_operator f.num_layers, :>, 3
+    assert keys("k", 3_000).all? { |k| f.include?(k) }
+    assert_operator keys("miss", 10_000).count { |k| f.include?(k) }, :<, 10_000 * 0.06
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_add_and_include_#{layout}") do
+      f = Filter.new(initial_capacity: 1_000, layout: layout)
+      keys("k", 5_000).each { |k| f.add(k) }
+
+      assert_equal layout, f.stats[:layout]
+      assert f.stats[:layers].all? { |l| l[:layout] == layout }
+      assert_operator f.num_layers, :>, 1
+      assert_equal 5_000, f.count
+      assert keys("k", 5_000).all? { |k| f.include?(k) }
+      assert_operator keys("miss", 10_000).count { |k| f.include?(k) }, :<, 10_000 * 0.06
+    end
+  end
+
+  def test_unknown_layout
+    assert_raises(ArgumentError) { Filter.new(layout: :sparse) }
+  end
+
+  def test_simd_kernel
+    assert_includes %w[avx2 scalar], FastBloomFilter::SIMD_KERNEL
+  end
+
+  # The AVX2 and scalar split-block kernels must set the same bits
+  def test_scalar_kernel_matches
+    script = <<~RUBY
+      f = FastBloomFilter::Filter.new(initial_capacity: 1_000, layout: :split_block)
+      5_000.times { |i| f.add("k\#{i}") }
+      hits = Array.new(20_000) { |i| f.include?("miss\#{i}") }
+      print Marshal.dump([FastBloomFilter::SIMD_KERNEL, f.stats, hits])
+    RUBY
+    kernel, stats, hits = in_scalar_process(script)
+
+    f = Filter.new(initial_capacity: 1_000, layout: :split_block)
+    keys("k", 5_000).each { |k| f.add(k) }
+    assert_equal "scalar", kernel
+    assert_equal f.stats, stats
+    assert_equal Array.new(20_000) { |i| f.include?("miss#{i}") }, hits
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_pow2_sizing_#{layout}") do
+      f = Filter.new(initial_capacity: 1_000, layout: layout, sizing: :pow2)
+      keys("k", 5_000).each { |k| f.add(k) }
+
+      assert_equal :pow2, f.stats[:sizing]
+      f.stats[:layers].each do |l|
+        assert_equal 0, l[:total_bits] & (l[:total_bits] - 1)
+        assert_operator l[:total_bits], :>=, l[:requested_bits]
+        assert_operator l[:expected_fpr], :<=, l[:error_rate]
+      end
+      assert keys("k", 5_000).all? { |k| f.include?(k) }
+      assert_operator keys("miss", 10_000).count { |k| f.include?(k) }, :<, 10_000 * 0.06
+    end
+  end
+
+  def test_exact_sizing_uses_requested_bits
+    f = Filter.new(initial_capacity: 1_000)
+    l = f.stats[:layers].first
+    assert_equal :exact, f.stats[:sizing]
+    assert_equal l[:requested_bits], l[:total_bits]
+    assert_raises(ArgumentError) { Filter.new(sizing: :round) }
+  end
+
+  # With a mask, an even probe step would revisit a subset of the
+  # slots: one key must set num_hashes distinct bits.
+  def test_pow2_probes_are_distinct
+    keys("k", 2_000).each do |k|
+      f = Filter.new(initial_capacity: 1, sizing: :pow2)
+      f.add(k)
+      l = f.stats[:layers].first
+      assert_equal l[:num_hashes], l[:bits_set], k
+    end
+  end
+
+  def test_small_layers_hash_with_32_bits
+    f = Filter.new(initial_capacity: 1_000)
+    assert_equal [32], f.stats[:layers].map { |l| l[:hash_bits] }
+  end
+
+  # A layer past 2^32 bits; only the pages its keys touch are faulted in
+  def test_huge_layers_hash_with_64_bits
+    f = begin
+      Filter.new(initial_capacity: 460_000_000)
+    rescue NoMemoryError
+      skip "cannot map a 550 MB layer"
+    end
+    keys("k", 8).each { |k| f.add(k) }
+
+    layer = f.stats[:layers].first
+    assert_operator layer[:total_bits], :>, 2**32
+    assert_equal 64, layer[:hash_bits]
+    assert keys("k", 8).all? { |k| f.include?(k) }
+    assert_equal 0, keys("miss", 1_000).count { |k| f.include?(k) }
+  end
+
+  def test_add_many
+    f = Filter.new(initial_capacity: 1_000)
+    assert_same f, f.add_many(keys("k", 5_000))
+    assert_equal 5_000, f.count
+    assert keys("k", 5_000).all? { |k| f.include?(k) }
+
+    f.add_many([1, :sym])  # converted with #to_s
+    assert f.include?("1")
+    assert f.include?("sym")
+    assert_raises(TypeError) { f.add_many("k") }
+  end
+
+  def test_add_all
+    f = Filter.new
+    f.add_all(keys("a", 100))
+    f.add_all(keys("e", 10_000).each)
+    assert_equal 10_100, f.count
+    assert keys("e", 10_000).all? { |k| f.include?(k) }
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_include_many_#{layout}") do
+      f     = filled(layout)
+      mixed = keys("k", 50) + keys("miss", 50)
+      each  = mixed.map { |k| f.include?(k) }
+
+      assert f.include_many(keys("k", 5_000)).all?
+      assert_equal each, f.include_many(mixed)
+      assert_equal each.map { |hit| hit ? "1" : "0" }.join,
+                   f.include_many(mixed, format: :bitmap).unpack1("b*")[0, mixed.size]
+      assert_equal each.count(true), f.count_possible_matches(mixed)
+    end
+  end
+
+  def test_include_many_format
+    f = Filter.new
+    assert_equal "".b, f.include_many([], format: :bitmap)
+    assert_raises(ArgumentError) { f.include_many(["a"], format: :set) }
+  end
+
+  def test_prefetch_window
+    f = Filter.new(initial_capacity: 1_000)
+    g = Filter.new(initial_capacity: 1_000, prefetch_window: 1)
+    assert_operator f.prefetch_window, :>, 1
+    assert_equal 1, g.prefetch_window
+
+    f.prefetch_window = 4
+    assert_equal 4, f.prefetch_window
+    assert_raises(ArgumentError) { Filter.new(prefetch_window: 0) }
+
+    [f, g].each { |x| x.add_many(keys("k", 5_000)) }
+    assert_equal f.stats, g.stats
+    mixed = keys("k", 5_000) + keys("miss", 5_000)
+    assert_equal g.include_many(mixed), f.include_many(mixed)
+  end
+
+  # Batches this large copy their keys and run without the GVL
+  def test_large_batches_from_several_threads
+    f       = Filter.new(initial_capacity: 1_000)
+    batches = Array.new(4) { |t| keys("t#{t}-", 20_000) }
+    batches.map { |b| Thread.new { f.add_many(b) } }.each(&:join)
+
+    assert_equal 80_000, f.count
+    results = batches.map { |b| Thread.new { f.include_many(b) } }.map(&:value)
+    assert results.all?(&:all?)
+  end
+
+  # Waiting for the filter lock releases the GVL: the key must not be
+  # read out of a String another thread is changing.
+  def test_keys_changed_while_adding
+    f   = Filter.new(initial_capacity: 1_000, concurrent: true)
+    key = +"stable"
+    threads = [
+      Thread.new { 10_000.times { f.add_many(keys("b", 100)) } },
+      Thread.new { 10_000.times { f.add(key); key.replace("stable") } }
+    ]
+    threads.each(&:join)
+    assert f.include?("stable")
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_concurrent_writers_lose_no_keys_#{layout}") do
+      f = Filter.new(initial_capacity: 1_000, layout: layout, concurrent: true)
+      assert f.stats[:concurrent]
+
+      threads = Array.new(4) do |t|
+        Thread.new do
+          f.add_many(keys("t#{t}-", 20_000))
+          keys("s#{t}-", 1_000).each { |k| f.add(k) }
+        end
+      end
+      threads.each(&:join)
+
+      assert_equal 84_000, f.count
+      4.times do |t|
+        assert f.include_many(keys("t#{t}-", 20_000)).all?
+        assert f.include_many(keys("s#{t}-", 1_000)).all?
+      end
+    end
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_dump_and_load_#{layout}") do
+      f = filled(layout)
+      assert_same_filter f, Filter.load(f.dump)
+      assert_same_filter f, Marshal.load(Marshal.dump(f))
+    end
+
+    define_method("test_corrupt_snapshots_#{layout}") do
+      dump = filled(layout).dump
+      corrupt = [
+        "",
+        "not a snapshot",
+        dump[0, dump.bytesize / 2],
+        dump.dup.tap { |d| d[0, 4] = "XXXX" },
+        with_layer_field(dump, 24, 2**62 + 16),        # slots
+        with_layer_field(dump, 16, 8),                 # size
+        with_layer_field(dump, 40, dump.bytesize + 64) # offset
+      ]
+      corrupt.each do |bytes|
+        assert_raises(ArgumentError) { Filter.load(bytes) }
+      end
+    end
+  end
+
+  def test_pow2_sizing_round_trip
+    LAYOUTS.each do |layout|
+      f = filled(layout, sizing: :pow2)
+      assert_same_filter f, Filter.load(f.dump)
+    end
+  end
+
+  def test_loaded_filter_keeps_growing
+    f = Filter.load(filled(:standard).dump)
+    f.add_many(keys("more", 20_000))
+    assert f.include_many(keys("k", 5_000) + keys("more", 20_000)).all?
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_open_mmap_#{layout}") do
+      f = filled(layout)
+      with_tmpfile do |path|
+        File.binwrite(path, f.dump)
+
+        reader = Filter.open_mmap(path)
+        assert_same_filter f, reader
+        assert reader.stats[:layers].all? { |l| l[:backing] == :mmap }
+        assert_raises(IOError) { reader.add("new") }
+
+        writer = Filter.open_mmap(path, mode: :read_write)
+        writer.add_many(keys("w", 10_000))
+        writer.sync
+
+        reopened = Filter.open_mmap(path)
+        assert reopened.include_many(keys("w", 10_000)).all?
+        assert reopened.include_many(keys("k", 5_000)).all?
+        assert_equal writer.count, reopened.count
+      end
+    end
+  end
+
+  def test_open_mmap_rejects_bad_files
+    with_tmpfile do |path|
+      File.binwrite(path, "not a snapshot")
+      assert_raises(ArgumentError) { Filter.open_mmap(path) }
+      assert_raises(Errno::ENOENT) { Filter.open_mmap(path + ".missing") }
+    end
+  end
+
+  # Layers past the file's spare table slots cannot live in the file
+  def test_open_mmap_refuses_layers_beyond_the_table
+    [false, true].each do |concurrent|
+      with_tmpfile do |path|
+        File.binwrite(path, Filter.new(initial_capacity: 100, concurrent: concurrent).dump)
+        writer = Filter.open_mmap(path, mode: :read_write)
+
+        added = 0
+        assert_raises(IOError) do
+          keys("k", 200_000).each_slice(1_000) do |slice|
+            writer.add_many(slice)
+            added += slice.size
+          end
+        end
+        assert_equal 9, writer.num_layers
+        assert writer.stats[:layers].all? { |l| l[:backing] == :mmap }
+        assert_raises(IOError) { writer.add_many(keys("more", 100_000)) }
+        writer.sync
+
+        reopened = Filter.open_mmap(path)
+        assert_equal writer.num_layers, reopened.num_layers
+        assert_equal writer.count, reopened.count
+        assert reopened.include_many(keys("k", added)).all?
+      end
+    end
+  end
+
+  def test_share_read_only
+    f = filled(:standard)
+    f.share!
+    assert f.stats[:shared]
+    assert f.stats[:layers].all? { |l| l[:backing] == :shared }
+    assert_raises(IOError) { f.add("x") }
+    assert_raises(IOError) { f.share! }
+
+    pid = fork { exit!(f.include_many(keys("k", 5_000)).all? ? 0 : 1) }
+    assert_equal 0, Process.wait2(pid)[1].exitstatus
+  end
+
+  def test_share_with_writers
+    f = Filter.new(initial_capacity: 10_000)
+    f.add_many(keys("k", 1_000))
+    f.share!(writers: true)
+
+    pids = Array.new(2) do |t|
+      fork do
+        f.add_many(keys("w#{t}-", 2_000))
+        exit!(0)
+      end
+    end
+    pids.each { |pid| Process.wait(pid) }
+
+    assert f.include_many(keys("k", 1_000) + keys("w0-", 2_000) + keys("w1-", 2_000)).all?
+    assert_equal 1, f.num_layers
+    assert_equal 1_000, f.count  # counts are per process
+  end
+
+  def test_shared_writers_stop_at_capacity
+    f = Filter.new(initial_capacity: 1_000)
+    f.share!(writers: true)
+
+    pid = fork do
+      f.add_many(keys("child", 500))
+      exit!(0)
+    end
+    Process.wait(pid)
+    assert f.include_many(keys("child", 500)).all?
+
+    added = 0
+    assert_raises(RuntimeError) do
+      2_000.times do
+        f.add("parent#{added}")
+        added += 1
+      end
+    end
+    assert_operator added, :<, 1_000
+    assert_equal 1, f.num_layers
+    assert_operator f.stats[:fill_ratio], :<=, 0.55
+  end
+
+  # No writer alone fills the layer, but together they do: each one must
+  # see the bits the others set.
+  def test_shared_writers_see_each_others_fill
+    f = Filter.new(initial_capacity: 10_000)
+    f.share!(writers: true)
+    r, w = IO.pipe
+
+    pids = Array.new(4) do |t|
+      fork do
+        r.close
+        added = 0
+        begin
+          keys("w#{t}-", 4_000).each { |k| f.add(k); added += 1 }
+        rescue RuntimeError
+        end
+        w.puts added
+        exit!(0)
+      end
+    end
+    w.close
+    pids.each { |pid| Process.wait(pid) }
+    added = r.read.split.map(&:to_i)
+
+    assert_equal 4, added.size
+    assert_operator added.min, :<, 4_000
+    assert_operator added.sum, :<, 11_000
+    assert_operator f.stats[:fill_ratio], :<=, 0.55
+  ensure
+    r&.close
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_dump_to_and_load_from_#{layout}") do
+      f = filled(layout)
+      [{}, { chunk_size: 1_024 }].each do |opts|
+        io = StringIO.new("".b)
+        assert_same io, f.dump_to(io, **opts)
+        assert_same_filter f, Filter.load_from(StringIO.new(io.string))
+      end
+    end
+  end
+
+  def test_dump_to_a_pipe
+    f    = filled(:standard)
+    r, w = IO.pipe
+    writer = Thread.new { f.dump_to(w, chunk_size: 4_096); w.close }
+    assert_same_filter f, Filter.load_from(r)
+    writer.join
+  ensure
+    r&.close
+  end
+
+  def test_corrupt_streams
+    io = StringIO.new("".b)
+    filled(:standard).dump_to(io, chunk_size: 4_096)
+    s = io.string
+
+    flipped = s.dup
+    flipped.setbyte(s.bytesize / 2, flipped.getbyte(s.bytesize / 2) ^ 1)
+    [flipped, s[0, s.bytesize - 3], s[0, s.bytesize - 8], "junkjunk"].each do |bytes|
+      assert_raises(ArgumentError) { Filter.load_from(StringIO.new(bytes)) }
+    end
+    assert_raises(ArgumentError) { Filter.new.dump_to(StringIO.new, chunk_size: 16) }
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_compressed_dumps_#{layout}") do
+      f = filled(layout)
+      assert_same_filter f, Filter.load(f.dump(compress: true))
+
+      io = StringIO.new("".b)
+      f.dump_to(io, compress: true, chunk_size: 1_024)
+      assert_same_filter f, Filter.load_from(StringIO.new(io.string))
+
+      sparse = Filter.new(initial_capacity: 1_000_000, layout: layout)
+      sparse.add("x")
+      assert_operator sparse.dump(compress: true).bytesize, :<, sparse.dump.bytesize / 10
+      assert_operator Marshal.dump(sparse).bytesize, :<, sparse.dump.bytesize / 10
+      assert Filter.load(sparse.dump(compress: true)).include?("x")
+    end
+  end
+
+  def test_compressed_snapshots_cannot_be_mapped
+    sparse = Filter.new(initial_capacity: 1_000_000)
+    sparse.add("x")
+    with_tmpfile do |path|
+      File.binwrite(path, sparse.dump(compress: true))
+      assert_raises(ArgumentError) { Filter.open_mmap(path) }
+    end
+  end
+
+  def test_compressed_dumps_while_writing
+    f    = Filter.new(initial_capacity: 100_000, concurrent: true)
+    stop = false
+    writers = Array.new(4) do |t|
+      Thread.new do
+        i = 0
+        until stop
+          f.add_many(keys("t#{t}-#{i}-", 1_000))
+          i += 1
+        end
+      end
+    end
+
+    50.times do
+      Filter.load(f.dump(compress: true))
+      Marshal.load(Marshal.dump(f))
+      io = StringIO.new("".b)
+      f.dump_to(io, compress: true)
+      Filter.load_from(StringIO.new(io.string))
+    end
+  ensure
+    stop = true
+    writers&.each(&:join)
+  end
+
+  def checkpoint(f)
+    io = StringIO.new("".b)
+    f.checkpoint(io)
+    io.string
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_checkpoint_and_replay_#{layout}") do
+      f    = filled(layout)
+      base = f.dump
+      f.track_changes!
+      assert_equal 0, f.stats[:dirty_pages]
+
+      checkpoints = [keys("c", 100), keys("d", 20_000), []].map do |batch|
+        f.add_many(batch)
+        checkpoint(f)
+      end
+
+      replica = Filter.load(base)
+      checkpoints.each { |c| replica.replay(StringIO.new(c)) }
+      assert_equal f.dump, replica.dump
+      assert_equal f.count, replica.count
+
+      # The second checkpoint does not apply to the base snapshot
+      assert_raises(ArgumentError) { Filter.load(base).replay(StringIO.new(checkpoints[1])) }
+    end
+  end
+
+  def test_checkpoint_needs_tracking
+    assert_raises(RuntimeError) { Filter.new.checkpoint(StringIO.new) }
+  end
+
+  # clear changes every page: a replica replays the whole new layer, or
+  # refuses the checkpoint while it still holds the layers clear dropped
+  def test_clear_then_checkpoint
+    f       = Filter.new(initial_capacity: 100_000, track_changes: true)
+    replica = Filter.load(f.dump)
+    f.add("old")
+    replica.replay(StringIO.new(checkpoint(f)))
+
+    f.clear
+    f.add("new")
+    replica.replay(StringIO.new(checkpoint(f)))
+    assert_equal f.dump, replica.dump
+    refute replica.include?("old")
+
+    g       = Filter.new(initial_capacity: 100, track_changes: true)
+    replica = Filter.load(g.dump)
+    g.add_many(keys("k", 1_000))
+    replica.replay(StringIO.new(checkpoint(g)))
+    g.clear
+    assert_raises(ArgumentError) { replica.replay(StringIO.new(checkpoint(g))) }
+  end
+
+  def test_layers_come_from_the_arena
+    f = filled(:standard)
+    assert f.stats[:layers].all? { |l| l[:backing] == :arena }
+    assert Filter.load(f.dump).stats[:layers].all? { |l| l[:backing] == :arena }
+  end
+
+  # Small filters must not each take a mapping of their own
+  def test_many_small_filters
+    filters = Array.new(70_000) { Filter.new(initial_capacity: 100) }
+    filters.each_with_index { |f, i| f.add("k#{i}") }
+    assert filters.each_with_index.all? { |f, i| f.include?("k#{i}") }
+  end
+
+  def test_pages
+    small = Filter.new(initial_capacity: 1_000)
+    assert_equal [:normal], small.stats[:layers].map { |l| l[:pages] }
+
+    plain = Filter.new(initial_capacity: 10_000_000, huge_pages: false)
+    assert_equal [:normal], plain.stats[:layers].map { |l| l[:pages] }
+    assert_raises(ArgumentError) { Filter.new(huge_pages: :always) }
+  end
+
+  # :transparent only when the kernel can back the layer with huge pages
+  def test_transparent_pages_need_thp
+    mode = File.read("/sys/kernel/mm/transparent_hugepage/enabled")[/\[(\w+)\]/, 1] rescue nil
+    big  = Filter.new(initial_capacity: 10_000_000)
+    pages = big.stats[:layers].first[:pages]
+
+    if mode == "always" || mode == "madvise"
+      assert_equal :transparent, pages
+    else
+      assert_equal :normal, pages
+    end
+  end
+
+  def test_compact_folds_merged_layers
+    a = Filter.new(initial_capacity: 1_000)
+    b = Filter.new(initial_capacity: 1_000)
+    a.add_many(keys("a", 300))
+    b.add_many(keys("b", 300))
+    a.merge!(b)
+    assert_equal 2, a.num_layers
+
+    assert_same a, a.compact!
+    assert_equal 1, a.num_layers
+    assert_equal 600, a.count
+    assert a.include_many(keys("a", 300) + keys("b", 300)).all?
+  end
+
+  def test_compact_rebuilds_from_keys
+    f = filled(:standard, 20_000)
+    assert_operator f.num_layers, :>, 3
+    f.compact!(keys("k", 20_000))
+
+    assert_equal 1, f.num_layers
+    assert f.include_many(keys("k", 20_000)).all?
+    f.compact!(keys("k", 20_000).each)
+    assert_equal 1, f.num_layers
+    assert_raises(TypeError) { f.compact!(5) }
+  end
+
+  def test_compact_skips_layers_over_capacity
+    a = Filter.new(initial_capacity: 100)
+    b = Filter.new(initial_capacity: 100)
+    c = Filter.new(initial_capacity: 100)
+    b.add_many(keys("b", 60))
+    c.add_many(keys("c", 60))
+    a.merge!(b)
+    a.merge!(c)
+    a.compact!
+    assert_equal 2, a.num_layers
+    a.compact!
+    assert_equal 2, a.num_layers
+  end
+
+  def test_adaptive_growth_with_expected_total
+    fixed    = filled(:standard, 100_000)
+    adaptive = filled(:standard, 100_000, expected_total: 100_000)
+
+    assert_equal :fixed, fixed.stats[:growth]
+    assert_equal :adaptive, adaptive.stats[:growth]
+    assert_equal 100_000, adaptive.stats[:expected_total]
+    assert_operator fixed.num_layers, :>=, 6
+    assert_operator adaptive.num_layers, :<=, 2
+    assert adaptive.include_many(keys("k", 100_000)).all?
+  end
+
+  def test_adaptive_growth_never_grows_less_than_fixed
+    fixed    = filled(:standard, 50_000)
+    adaptive = filled(:standard, 50_000, growth: :adaptive)
+    assert_operator adaptive.num_layers, :<=, fixed.num_layers
+
+    assert_raises(ArgumentError) { Filter.new(growth: :fast) }
+    assert_raises(ArgumentError) { Filter.new(growth: :fixed, expected_total: 10) }
+    assert_raises(ArgumentError) { Filter.new(growth: :adaptive, growth_horizon: 0) }
+  end
+
+  def test_growth_policy_survives_snapshots
+    f = Filter.new(initial_capacity: 1_000, expected_total: 100_000, growth_horizon: 60)
+    f.add_many(keys("k", 2_000))
+    io = StringIO.new("".b)
+    f.dump_to(io)
+
+    [Filter.load(f.dump), Filter.load_from(StringIO.new(io.string)), Marshal.load(Marshal.dump(f))].each do |g|
+      assert_equal :adaptive, g.stats[:growth]
+      assert_equal 100_000, g.stats[:expected_total]
+      g.add_many(keys("more", 98_000))
+      assert_operator g.num_layers, :<=, 3
+    end
+    assert_equal :fixed, Filter.load(Filter.new.dump).stats[:growth]
+  end
+
+  # bits_set is counted as bits flip; it must match the bits themselves
+  def test_bits_set_matches_a_recount
+    %i[standard blocked split_block].each do |layout|
+      f    = filled(layout, 20_000)
+      dump = f.dump
+      f.stats[:layers].each_with_index do |l, i|
+        assert_equal layer_bytes(dump, i).unpack1("B*").count("1"), l[:bits_set]
+      end
+      assert_equal comparable_stats(f), comparable_stats(Filter.load(dump))
+    end
+  end
+
+  def test_scalar_popcount_matches
+    f = filled(:blocked, 20_000)
+    script = <<~RUBY
+      f = FastBloomFilter::Filter.load(STDIN.binmode.read)
+      print Marshal.dump(f.stats[:layers].map { |l| l[:bits_set] })
+    RUBY
+    lib = File.expand_path("../lib", __dir__)
+    env = { "FAST_BLOOM_FILTER_SIMD" => "scalar" }
+    out = IO.popen(env, [RbConfig.ruby, "-I", lib, "-rfast_bloom_filter", "-e", script], "r+b") do |io|
+      io.write(f.dump)
+      io.close_write
+      io.read
+    end
+    assert_equal f.stats[:layers].map { |l| l[:bits_set] }, Marshal.load(out)
+    assert_includes %w[avx512 avx2 popcnt scalar], FastBloomFilter::POPCOUNT_KERNEL
+  end
+
+  def test_metrics
+    f = filled(:standard)
+    f.include?("k1")
+    f.include_many(keys("miss", 10))
+    m = f.metrics
+
+    assert m.frozen?
+    assert_equal 5_000, m[:adds]
+    assert_equal 11, m[:lookups]
+    assert_operator m[:positives], :>=, 1
+    assert_equal f.count, m[:count]
+    assert_equal f.num_layers, m[:num_layers]
+    assert_equal f.count, m[:layer_counts].sum
+    assert_equal f.stats[:total_bytes], m[:bytes]
+    assert_equal m[:bytes], m[:layer_bytes].sum
+    assert_operator m[:estimated_fpr], :<, 0.05
+  end
+
+  def test_metrics_count_inserted_keys
+    f = Filter.new
+    f.add?("a")
+    f.add?("a")
+    f.add("b")
+    f.include?("a")
+    m = f.metrics
+    assert_equal 2, m[:adds]
+    assert_equal 3, m[:lookups]
+    assert_equal 2, m[:positives]
+  end
+
+  def test_estimated_cardinality
+    f = Filter.new(initial_capacity: 100_000)
+    3.times { f.add_many(keys("k", 20_000)) }
+
+    assert_equal 60_000, f.count
+    assert_in_delta 20_000, f.estimated_cardinality, 20_000 * 0.05
+    assert_equal f.estimated_cardinality, f.stats[:estimated_cardinality]
+  end
+
+  # Duplicates set no new bits, so fill-based rollover ignores them
+  def test_fill_rollover
+    count = Filter.new(initial_capacity: 1_000)
+    fill  = Filter.new(initial_capacity: 1_000, rollover: :fill)
+    [count, fill].each { |f| 5.times { f.add_many(keys("k", 5_000)) } }
+
+    assert_equal :fill, fill.stats[:rollover]
+    assert_operator fill.num_layers, :<, count.num_layers
+    assert_operator fill.estimated_cardinality, :<, count.estimated_cardinality
+    assert fill.include_many(keys("k", 5_000)).all?
+    assert_operator fill.include_many(keys("miss", 10_000)).count(true), :<, 10_000 * 0.06
+
+    assert_equal :fill, Filter.load(fill.dump).stats[:rollover]
+    assert_raises(ArgumentError) { Filter.new(rollover: :size) }
+  end
+
+  LAYOUTS.each do |layout|
+    define_method("test_add_p_#{layout}") do
+      f = Filter.new(initial_capacity: 1_000, layout: layout)
+      refute f.add?("a")
+      assert f.add?("a")
+      assert f.include?("a")
+
+      fresh = keys("k", 5_000).count { |k| !f.add?(k) }
+      assert_operator fresh, :>, 4_900
+      assert keys("k", 5_000).all? { |k| f.add?(k) }
+      assert_equal 1 + fresh, f.count
+      assert_equal f.count, f.metrics[:adds]
+    end
+  end
+
+  def test_delete
+    f = Filter.new(initial_capacity: 1_000, layout: :counting)
+    f.add("a")
+    f.add("a")
+    assert f.delete("a")
+    assert f.include?("a")
+    assert f.delete("a")
+    refute f.include?("a")
+    refute f.delete("never-added")
+    assert_equal 0, f.count
+  end
+
+  def test_delete_survives_round_trips
+    f = filled(:counting)
+    g = Filter.load(f.dump(compress: true))
+    assert g.delete("k1")
+    refute g.include?("k1")
+  end
+
+  def test_delete_needs_counting_layout
+    assert_raises(NotImplementedError) { Filter.new.delete("a") }
+  end
+
+  def test_counting_stats
+    f = filled(:counting)
+    assert_equal 0.0, f.stats[:counter_overflow_rate]
+    f.stats[:layers].each { |l| assert_equal 0, l[:saturated_counters] }
+
+    16.times { f.add("hot") }
+    assert_operator f.stats[:layers].last[:saturated_counters], :>, 0
+  end
+
+  def test_delete_after_add_p_repeats
+    f = Filter.new(initial_capacity: 1_000, layout: :counting)
+    refute f.add?("a")
+    5.times { assert f.add?("a") }
+    assert f.delete("a")
+    refute f.include?("a")
+  end
+
+  def test_delete_key_added_again_after_rollover
+    f = Filter.new(initial_capacity: 100, layout: :counting)
+    f.add("a")
+    f.add_many(keys("k", 300))
+    assert_operator f.num_layers, :>, 1
+    f.add("a")
+
+    assert f.delete("a")
+    assert f.delete("a")
+    refute f.include?("a")
+    assert f.include_many(keys("k", 300)).all?
+  end
+
+  # slots * 4 bits wraps to a few bytes: must not pass as an 8-byte array
+  def test_crafted_counting_slots_overflow
+    f    = Filter.new(initial_capacity: 100, layout: :counting)
+    dump = f.dump
+    bad  = with_layer_field(with_layer_field(dump, 24, 2**62 + 16), 16, 8)
+    assert_raises(ArgumentError) { Filter.load(bad) }
+
+    packed     = f.dump(compress: true)
+    bad_packed = with_layer_field(with_layer_field(packed, 24, 2**62 + 16), 16, 8)
+    marshaled  = Marshal.dump(f).b
+    assert_includes marshaled, packed.b
+    assert_raises(ArgumentError) { Marshal.load(marshaled.sub(packed.b, bad_packed)) }
+
+    with_tmpfile do |path|
+      File.binwrite(path, bad)
+      assert_raises(ArgumentError) { Filter.open_mmap(path) }
+    end
+  end
+
+  def test_slots_must_fill_whole_bytes
+    dump = Filter.new(initial_capacity: 100).dump
+    size = dump.b[128 + 16, 8].unpack1("Q<")
+    assert_raises(ArgumentError) { Filter.load(with_layer_field(dump, 24, size * 8 + 1)) }
+  end
+
+  # add? must decide by the layer it wrote, whatever the filter's layout
+  def test_add_p_into_a_merged_counting_layer
+    f = Filter.new(initial_capacity: 1_000)
+    counting = Filter.new(initial_capacity: 1_000, layout: :counting)
+    f.merge!(counting)  # the counting layer becomes the active one
+
+    refute f.add?("a")
+    assert f.add?("a")
+    assert_equal 1, f.count
+
+    # probing by setting would have bumped the member's counters each time
+    20.times { assert f.add?("a") }
+    assert_equal 0, f.stats[:layers].last[:saturated_counters]
+    refute f.add_many(keys("k", 200)).nil?
+    assert_equal [true] * 200, keys("k", 200).map { |k| f.add?(k) }
+    assert_equal 201, f.count
+  end
+
+  def test_add_p_into_a_merged_bit_layer
+    f = Filter.new(initial_capacity: 1_000, layout: :counting)
+    f.merge!(Filter.new(initial_capacity: 1_000))
+
+    refute f.add?("a")
+    assert f.add?("a")
+    assert_equal 1, f.count
+  end
+
+  # An IO that calls back into the filter it is being written from
+  class ReentrantIO < StringIO
+    attr_accessor :filter, :call
+
+    def write(*args)
+      call.call(filter) if filter
+      super
+    end
+  end
+
+  def test_io_may_not_reenter_a_streaming_filter
+    f  = filled(:standard)
+    io = ReentrantIO.new("".b)
+    io.filter = f
+
+    [->(g) { g.add("from io") }, ->(g) { g.include?("k1") },
+     ->(g) { g.add_many(keys("io", 20_000)) }].each do |reenter|
+      io.call = reenter
+      assert_raises(ThreadError) { f.dump_to(io) }
+    end
+
+    f.track_changes!
+    f.add("dirty")
+    io.call = ->(g) { g.add("from io") }
+    assert_raises(ThreadError) { f.checkpoint(io) }
+
+    # the lock was released, and another filter may be used from the IO
+    other = Filter.new
+    io.filter = other
+    f.dump_to(io)
+    assert other.include?("from io")
+    f.add("after")
+    assert f.include?("after")
+  end
+
+  def test_other_threads_wait_for_a_streaming_filter
+    f  = filled(:standard)
+    io = ReentrantIO.new("".b)
+    io.filter = f
+    io.call = ->(g) { Thread.new { g.include?("k1") }.join(0.01) }
+    f.dump_to(io)
+    assert f.include?("k1")
+  end
+end